@@ -4,6 +4,7 @@
 #include <initializer_list>
 #include <vector>
 #include <chrono>
+#include "../resnet50_conv3x3/onednn/simd.hpp"
 
 
 template <typename contTy>
@@ -165,6 +166,11 @@ struct Range {
         return Range<dtype, unrollLen, newStepLen>(start, stop);
     }
 
+    // vector-width mode keeping the unroll factor, see simd::VecRange
+    auto vectorize() -> simd::VecRange<dtype, unrollLen> {
+        return simd::VecRange<dtype, unrollLen>(start, stop);
+    }
+
     template <typename Func>
     void foreach(Func func) const {
         constexpr int unrolledStep = unrollLen * stepLen;
@@ -180,95 +186,6 @@ struct Range {
 };
 
 
-template <typename dtype, int Dims, int High, int... Lowers>
-struct Storage {
-    const Storage<dtype, Dims-1, Lowers...> lowerdims;
-    const Storage<dtype, Dims, High-1, Lowers...> siblings;
-
-    template <bool dimcheck>
-    Storage(const dtype *arr, const DimIdx<Dims, dimcheck> &di)
-        : lowerdims(arr, di.sub), siblings(arr + di.step, di) { }
-
-    template <int H2, int... L2>
-    dtype fetch() const {
-        if (H2 == 0)
-            return lowerdims.fetch<L2...>();
-        else
-            return siblings.fetch<H2-1, L2...>();
-    }
-};
-template <typename dtype, int Dims, int... Lowers>
-struct Storage<dtype, Dims, 1, Lowers...> {
-    const Storage<dtype, Dims-1, Lowers...> lowerdims;
-
-    template <bool dimcheck>
-    Storage(const dtype *arr, const DimIdx<Dims, dimcheck> &di)
-        : lowerdims(arr, di.sub) { }
-
-    template <int H2, int... L2>
-    dtype fetch() const {
-        //static_assert(H2 == 0, "");
-        return lowerdims.fetch<L2...>();
-    }
-};
-template <typename dtype, int High>
-struct Storage<dtype, 1, High> {
-    const dtype val;
-    const Storage<dtype, 1, High-1> siblings;
-
-    template <bool dimcheck>
-    Storage(const dtype *arr, const DimIdx<1, dimcheck> &di)
-        : val(*arr), siblings(arr + 1, di) { }
-
-    template <int H2>
-    dtype fetch() const {
-        if (H2 == 0)
-            return val;
-        else
-            return siblings.fetch<H2-1>();
-    }
-};
-template <typename dtype>
-struct Storage<dtype, 1, 1> {
-    const dtype val;
-
-    template <bool dimcheck>
-    Storage(const dtype *arr, const DimIdx<1, dimcheck> &di)
-        : val(*arr) { }
-
-    template <int H2>
-    dtype fetch() const {
-        //static_assert(H2 == 0, "");
-        return val;
-    }
-};
-
-
-template <typename dtype, int hlen, int wlen>
-struct kernel {
-    const Storage<dtype, 2, 3, 3> &wStore;
-    const Storage<dtype, 2, hlen+2, wlen+2> iStore;
-
-    template <bool dimcheck>
-    kernel(const dtype *img, const DimIdx<2, dimcheck> &di, const Storage<dtype, 2, 3, 3> &wS)
-        : wStore(wS), iStore(img, di) { }
-
-    template <int hoff, int woff>
-    dtype compute() const {
-        dtype val = 0;
-        val += wStore.template fetch<0, 0>() * iStore.template fetch<hoff+0, woff+0>();
-        val += wStore.template fetch<0, 1>() * iStore.template fetch<hoff+0, woff+1>();
-        val += wStore.template fetch<0, 2>() * iStore.template fetch<hoff+0, woff+2>();
-        val += wStore.template fetch<1, 0>() * iStore.template fetch<hoff+1, woff+0>();
-        val += wStore.template fetch<1, 1>() * iStore.template fetch<hoff+1, woff+1>();
-        val += wStore.template fetch<1, 2>() * iStore.template fetch<hoff+1, woff+2>();
-        val += wStore.template fetch<2, 0>() * iStore.template fetch<hoff+2, woff+0>();
-        val += wStore.template fetch<2, 1>() * iStore.template fetch<hoff+2, woff+1>();
-        val += wStore.template fetch<2, 2>() * iStore.template fetch<hoff+2, woff+2>();
-        return val;
-    }
-};
-
 template <typename dtype>
 tensor<dtype> conv2d(const tensor<dtype> &img, const tensor<dtype> &weight) {
     DimIdx<4> dimImg(img.dims), dimWeight(weight.dims);
@@ -280,27 +197,28 @@ tensor<dtype> conv2d(const tensor<dtype> &img, const tensor<dtype> &weight) {
     assert (Ker == 3);
     tensor<dtype> ret { N, Cout, H-2, W-2 };
     DimIdx<4> dimRet(ret.dims);
+    using simd::VecF;
     for (auto in: Range<>(0, N)) {
     for (auto co: Range<>(0, Cout)) {
     for (auto ci: Range<>(0, Cin)) {
-        Storage<dtype, 2, 3, 3> wStore(&weight(dimWeight, co, ci, 0, 0), dimWeight.sub.sub);
+        VecF wvec[3][3];
+        Range<>(0, 3).fullUnroll<3>().foreach([&] (int kh, int kh2) {
+        Range<>(0, 3).fullUnroll<3>().foreach([&] (int kw, int kw2) {
+            wvec[kh][kw] = VecF::broadcast(weight(dimWeight, co, ci, kh, kw));
+        });
+        });
     for (auto ih: Range<>(0, H-2)) {
-    for (auto iw: Range<>(0, W-2).stepBy<2>()) {
-        if (iw + 2 <= W-2) {
-            kernel<dtype, 1, 2> cobj(&img(dimImg, in, ci, ih, iw), dimImg.sub.sub, wStore);
-            ret(dimRet, in, co, ih+0, iw+0) += cobj.template compute<0, 0>();
-            ret(dimRet, in, co, ih+0, iw+1) += cobj.template compute<0, 1>();
-        } else {
-            kernel<dtype, 1, 1> cobj(&img(dimImg, in, ci, ih, iw), dimImg.sub.sub, wStore);
-            ret(dimRet, in, co, ih+0, iw+0) += cobj.template compute<0, 0>();
-        }
-        //Range<>(0, 3).fullUnroll<3>().foreach([&] (int kh, int kh2) {
-        //Range<>(0, 3).fullUnroll<3>().foreach([&] (int kw, int kw2) {
-        //     val += weight(dimWeight, co, ci, kh, kw)
-        //          * img(dimImg, in, ci, ih+kh, iw+kw);
-        //});
-        //});
-    }
+        const dtype *irow = &img(dimImg, in, ci, ih, 0);
+        dtype *orow = &ret(dimRet, in, co, ih, 0);
+        Range<>(0, W-2).unrollBy<2>().vectorize().foreach([&] (std::size_t iw, simd::Mask m) {
+            auto val = VecF::load(orow + iw, m);
+            Range<>(0, 3).fullUnroll<3>().foreach([&] (int kh, int kh2) {
+            Range<>(0, 3).fullUnroll<3>().foreach([&] (int kw, int kw2) {
+                val = fmadd(wvec[kh][kw], VecF::load(irow + kh * W + iw + kw, m), val);
+            });
+            });
+            val.store(orow + iw, m);
+        });
     }
     }
     }
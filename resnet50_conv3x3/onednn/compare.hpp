@@ -0,0 +1,166 @@
+#ifndef _COMPARE_HPP_
+#define _COMPARE_HPP_
+#include "tensorutils.hpp"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+
+// Samples of convert + compute ms per (fmt, alg, impl, spfmt, sparsity,
+// F, H, C, K, S), gathered from the conv,... lines of a run's output.
+typedef std::map<std::string, std::vector<double>> samples_t;
+
+inline samples_t read_samples(std::istream &is) {
+    samples_t ret;
+    std::string line;
+    while (std::getline(is, line)) {
+        std::vector<std::string> fields;
+        std::istringstream ls(line);
+        std::string field;
+        while (std::getline(ls, field, ',')) fields.push_back(field);
+        if (fields.size() != 13 || fields[0] != "conv") continue;
+        std::string key = fields[1];
+        for (int i = 2; i <= 10; i++) key += ',' + fields[i];
+        ret[key].push_back(std::atof(fields[11].c_str())
+                           + std::atof(fields[12].c_str()));
+    }
+    return ret;
+}
+
+// two-sided 95% Student t quantile, Cornish-Fisher expansion around the
+// normal one; within 1% of the exact value from df = 3 on
+inline double t_quantile95(double df) {
+    const double z = 1.959964;
+    double z2 = z * z, z3 = z2 * z, z5 = z3 * z2, z7 = z5 * z2, z9 = z7 * z2;
+    return z + (z3 + z) / (4 * df)
+             + (5 * z5 + 16 * z3 + 3 * z) / (96 * df * df)
+             + (3 * z7 + 19 * z5 + 17 * z3 - 15 * z) / (384 * df * df * df)
+             + (79 * z9 + 776 * z7 + 1482 * z5 - 1920 * z3 - 945 * z)
+               / (92160 * df * df * df * df);
+}
+
+inline void mean_var(const std::vector<double> &v, double &mean, double &var) {
+    mean = 0;
+    for (auto x: v) mean += x;
+    mean /= v.size();
+    var = 0;
+    for (auto x: v) var += (x - mean) * (x - mean);
+    var /= std::max<std::size_t>(1, v.size() - 1);
+}
+
+// Welch's t-test of each key's new samples against the baseline ones.
+// Prints one line per key,
+//   cmp,<key>,base_ms,new_ms,speedup,ci_lo,ci_hi,verdict
+// with the 95% interval of the relative time change, and returns how many
+// keys got slower significantly and by more than threshold (a fraction).
+inline int compare_samples(const samples_t &base, const samples_t &cur,
+                           double threshold, std::ostream &os) {
+    int regressions = 0;
+    for (auto &b: base) {
+        auto it = cur.find(b.first);
+        if (it == cur.end()) {
+            os << "cmp," << b.first << ",,,,,,missing" << std::endl;
+            continue;
+        }
+        auto &s1 = b.second, &s2 = it->second;
+        double m1, v1, m2, v2;
+        mean_var(s1, m1, v1);
+        mean_var(s2, m2, v2);
+        os << "cmp," << b.first << ',' << m1 << ',' << m2 << ',' << m1 / m2;
+        if (s1.size() < 2 || s2.size() < 2) {
+            os << ",,,few" << std::endl;
+            continue;
+        }
+        double e1 = v1 / s1.size(), e2 = v2 / s2.size(), se = std::sqrt(e1 + e2);
+        double df = (e1 + e2) * (e1 + e2)
+                  / (e1 * e1 / (s1.size() - 1) + e2 * e2 / (s2.size() - 1));
+        double half = se > 0 ? t_quantile95(std::max(1.0, df)) * se : 0;
+        double lo = (m2 - m1 - half) / m1, hi = (m2 - m1 + half) / m1;
+        const char *verdict = "same";
+        if (hi < 0) {
+            verdict = "faster";
+        } else if (lo > 0) {
+            verdict = "slower";
+            if ((m2 - m1) / m1 > threshold) {
+                verdict = "regression";
+                regressions++;
+            }
+        }
+        os << ',' << lo << ',' << hi << ',' << verdict << std::endl;
+    }
+    for (auto &c: cur)
+        if (!base.count(c.first))
+            os << "cmp," << c.first << ",,,,,,new" << std::endl;
+    return regressions;
+}
+
+
+// Copies everything written to a stream into a string as well.
+class TeeBuf: public std::streambuf {
+    std::streambuf *orig;
+    std::string copy;
+
+protected:
+    int overflow(int ch) {
+        if (ch == traits_type::eof()) return traits_type::not_eof(ch);
+        copy += traits_type::to_char_type(ch);
+        return orig->sputc(ch);
+    }
+
+    std::streamsize xsputn(const char *s, std::streamsize n) {
+        copy.append(s, n);
+        return orig->sputn(s, n);
+    }
+
+    int sync() { return orig->pubsync(); }
+
+public:
+    TeeBuf(std::streambuf *orig): orig(orig) {}
+    const std::string &str() const { return copy; }
+};
+
+// CB_BASELINE=<csv> compares the run against a stored output of the same
+// binary: std::cout is captured while the benchmark runs, and finish()
+// prints the cmp lines and returns nonzero if some (layer, implementation)
+// regressed by more than CB_REGRESS_PCT percent (default 5).
+class BaselineCompare {
+    std::string path;
+    TeeBuf tee;
+    std::streambuf *orig;
+
+public:
+    BaselineCompare()
+        : path(env_or("CB_BASELINE", "")), tee(std::cout.rdbuf()), orig(nullptr) {
+        if (!path.empty()) orig = std::cout.rdbuf(&tee);
+    }
+
+    ~BaselineCompare() {
+        if (orig) std::cout.rdbuf(orig);
+    }
+
+    int finish() {
+        if (!orig) return 0;
+        std::cout.rdbuf(orig);
+        orig = nullptr;
+        std::ifstream bf(path);
+        if (!bf) {
+            std::cerr << "cannot read baseline " << path << std::endl;
+            return 2;
+        }
+        auto base = read_samples(bf);
+        std::istringstream cs(tee.str());
+        auto cur = read_samples(cs);
+        int bad = compare_samples(base, cur,
+                env_or("CB_REGRESS_PCT", 5.0) / 100, std::cout);
+        std::cout << "cmp,summary," << base.size() << ',' << bad << std::endl;
+        return bad ? 1 : 0;
+    }
+};
+
+#endif  // _COMPARE_HPP_
@@ -0,0 +1,145 @@
+#include "convapi.h"
+#include "registry.hpp"
+#include <climits>
+#include <exception>
+#include <string>
+
+
+struct cb_conv {
+    const ConvAlgo *algo;
+    std::int64_t N, C, H, W, F, OH, OW;
+    ConvPtr impl;
+};
+
+namespace {
+
+thread_local std::string last_error;
+
+int fail(int code, const std::string &msg) {
+    last_error = msg;
+    return code;
+}
+
+// position of N, C, H, W (or F, C, K, K) in each layout's order
+const int layout_perm[2][4] = {{0, 1, 2, 3}, {0, 3, 1, 2}};
+
+// t as a view indexed (n, c, h, w), or (f, c, kh, kw) for weights
+bool canonical(const cb_tensor *t, view_t &v) {
+    if (!t || (t->layout != CB_NCHW && t->layout != CB_NHWC)) return false;
+    for (int d = 0; d < 4; d++) {
+        auto sz = t->sizes[layout_perm[t->layout][d]];
+        if (sz <= 0 || sz > INT_MAX) return false;
+        v.sizes[d] = sz;
+        v.strides[d] = t->strides[layout_perm[t->layout][d]];
+    }
+    v.data = t->data;
+    v.layout = t->layout == CB_NHWC ? Layout::NHWC : Layout::NCHW;
+    return true;
+}
+
+template <typename Fn>
+int guarded(Fn fn) {
+    try {
+        return fn();
+    } catch (const std::exception &e) {
+        return fail(CB_EINTERNAL, e.what());
+    } catch (...) {
+        return fail(CB_EINTERNAL, "unknown exception");
+    }
+}
+
+}  // end namespace
+
+
+extern "C" {
+
+int cb_api_version(void) { return CB_API_VERSION; }
+
+const char *cb_last_error(void) { return last_error.c_str(); }
+
+const char *cb_algo_name(int i) {
+    auto &algos = conv_algos();
+    return i >= 0 && i < int(algos.size()) ? algos[i].name.c_str() : nullptr;
+}
+
+void cb_set_num_threads(int n) {
+    if (n <= 0) return;
+#ifdef _OPENMP
+    omp_set_num_threads(n);
+#endif
+    mkl_set_num_threads(n);
+}
+
+int cb_conv_create(cb_conv **conv, const char *algo, const cb_tensor *input,
+                   const cb_tensor *weight, int stride, int pad) {
+    return guarded([&] {
+        view_t in, wv;
+        if (!conv) return fail(CB_EINVAL, "conv is NULL");
+        *conv = nullptr;
+        auto found = find_algo(algo ? algo : "");
+        if (!found) return fail(CB_EINVAL, std::string("unknown algo ") + (algo ? algo : ""));
+        if (!canonical(input, in) || !canonical(weight, wv) || !weight->data)
+            return fail(CB_EINVAL, "bad tensor descriptor");
+        int N = in.sizes[0], C = in.sizes[1], H = in.sizes[2], W = in.sizes[3];
+        int F = wv.sizes[0], K = wv.sizes[2];
+        if (wv.sizes[1] != C || wv.sizes[3] != K)
+            return fail(CB_EINVAL, "weight is not F x C x K x K for the input's C");
+        if (stride <= 0 || pad < 0 || H + 2 * pad < K || W + 2 * pad < K)
+            return fail(CB_EINVAL, "bad stride or padding");
+        ConvShape shape {F, C, K, K, stride, pad, std::max(H, W)};
+        // sparsity 0: no pruning, see conv_algos
+        if (!found->supports(shape, N, 0))
+            return fail(CB_EUNSUPPORTED, found->name + " does not support this layer");
+
+        tensor_t w(std::size_t(F) * C * K * K), zeros(std::size_t(N) * C * H * W);
+        auto aW = DimIdx<4>{F, C, K, K}.bind(w);
+        for (int f = 0; f < F; f++)
+            for (int c = 0; c < C; c++)
+                for (int kh = 0; kh < K; kh++)
+                    for (int kw = 0; kw < K; kw++)
+                        aW(f, c, kh, kw) = wv(f, c, kh, kw);
+        CaseProvider cp(zeros, {N, C, H, W}, w, {F, C, K, K}, stride, pad);
+        std::unique_ptr<cb_conv> ret(new cb_conv {found, N, C, H, W, F,
+                (H + 2 * pad - K) / stride + 1, (W + 2 * pad - K) / stride + 1, nullptr});
+        ret->impl = found->create(cp, 0);
+        *conv = ret.release();
+        return int(CB_OK);
+    });
+}
+
+int cb_conv_output_sizes(const cb_conv *conv, int layout, int64_t sizes[4]) {
+    if (!conv || !sizes || (layout != CB_NCHW && layout != CB_NHWC))
+        return fail(CB_EINVAL, "bad arguments");
+    const std::int64_t nchw[4] = {conv->N, conv->F, conv->OH, conv->OW};
+    for (int d = 0; d < 4; d++) sizes[layout_perm[layout][d]] = nchw[d];
+    return CB_OK;
+}
+
+int cb_conv_run(cb_conv *conv, const cb_tensor *input, const cb_tensor *output,
+                double ms[2]) {
+    return guarded([&] {
+        view_t in, out;
+        if (!conv) return fail(CB_EINVAL, "conv is NULL");
+        if (!canonical(input, in) || !canonical(output, out)
+                || !input->data || !output->data)
+            return fail(CB_EINVAL, "bad tensor descriptor");
+        const std::int64_t want_in[4] = {conv->N, conv->C, conv->H, conv->W};
+        const std::int64_t want_out[4] = {conv->N, conv->F, conv->OH, conv->OW};
+        for (int d = 0; d < 4; d++)
+            if (in.sizes[d] != want_in[d] || out.sizes[d] != want_out[d])
+                return fail(CB_EINVAL, "tensor sizes differ from the created shape");
+        // dense unpadded inputs are read in place, see load_input
+        conv->impl->load_input(in);
+        auto times = conv->impl->run();
+        conv->impl->store_result(out);
+        if (ms) {
+            ms[0] = times.first;
+            ms[1] = times.second;
+        }
+        return int(CB_OK);
+    });
+}
+
+void cb_conv_destroy(cb_conv *conv) { delete conv; }
+
+}  // extern "C"
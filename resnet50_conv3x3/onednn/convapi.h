@@ -0,0 +1,71 @@
+#ifndef _CONVAPI_H_
+#define _CONVAPI_H_
+#include <stddef.h>
+#include <stdint.h>
+
+/* C interface of libconvbench.so, the forward conv implementations of
+ * registry.hpp over caller-owned buffers.  A tensor is described by a data
+ * pointer and the sizes and element strides of its four dimensions, given
+ * in the order its layout tag names, so any NumPy or PyTorch view of
+ * float32 can be passed as is.  Functions returning int give CB_OK or a
+ * negative code, with a message in cb_last_error() for the calling thread.
+ * Bump CB_API_VERSION on any incompatible change. */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CB_API_VERSION 2
+
+enum cb_status {
+    CB_OK = 0,
+    CB_EINVAL = -1,     /* bad descriptor, shape mismatch or unknown algo */
+    CB_EUNSUPPORTED = -2,
+    CB_EINTERNAL = -3
+};
+
+enum cb_layout {
+    CB_NCHW = 0,        /* sizes and strides as (N, C, H, W), weights (F, C, K, K) */
+    CB_NHWC = 1         /* as (N, H, W, C), weights (F, K, K, C) */
+};
+
+typedef struct {
+    float *data;
+    int64_t sizes[4];
+    int64_t strides[4]; /* in elements */
+    int layout;
+} cb_tensor;
+
+typedef struct cb_conv cb_conv;
+
+int cb_api_version(void);
+const char *cb_last_error(void);
+
+/* names usable as `algo`, i from 0 while non-NULL */
+const char *cb_algo_name(int i);
+
+/* sets the OpenMP and MKL threads of later calls, 0 keeps the default */
+void cb_set_num_threads(int n);
+
+/* Builds `algo` for inputs shaped like input->sizes (input->data is not
+ * read) and packs the weights, which may be freed afterwards.  Every
+ * algorithm computes with the weights as given; sparse ones store their
+ * nonzeros, so the caller prunes beforehand. */
+int cb_conv_create(cb_conv **conv, const char *algo, const cb_tensor *input,
+                   const cb_tensor *weight, int stride, int pad);
+
+/* output sizes for the created shape, in the order of `layout` */
+int cb_conv_output_sizes(const cb_conv *conv, int layout, int64_t sizes[4]);
+
+/* One pass: reads input, computes and writes output.  ms, when not NULL,
+ * receives the conversion and compute time of the pass, without the
+ * input and output copies. */
+int cb_conv_run(cb_conv *conv, const cb_tensor *input, const cb_tensor *output,
+                double ms[2]);
+
+void cb_conv_destroy(cb_conv *conv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* _CONVAPI_H_ */
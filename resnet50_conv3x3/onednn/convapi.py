@@ -0,0 +1,201 @@
+"""ctypes binding of libconvbench.so (see convapi.h).
+
+NumPy arrays and CPU torch tensors of float32 are passed by pointer, sizes
+and strides, so views, channels_last tensors and slices work without
+copies.  Run as a script to time the PyTorch reference and our kernels on
+the same in-memory tensors:
+
+    python convapi.py [fmt.txt] [dat.bin] [algo ...]
+
+CB_LIB overrides the library path, default libconvbench.so next to this
+file.
+"""
+import ctypes
+import os
+import sys
+import time
+
+CB_NCHW, CB_NHWC = 0, 1
+API_VERSION = 2
+
+
+class _Tensor(ctypes.Structure):
+    _fields_ = [('data', ctypes.c_void_p),
+                ('sizes', ctypes.c_int64 * 4),
+                ('strides', ctypes.c_int64 * 4),
+                ('layout', ctypes.c_int)]
+
+
+def _load():
+    path = os.environ.get('CB_LIB') or os.path.join(
+        os.path.dirname(os.path.abspath(__file__)), 'libconvbench.so')
+    lib = ctypes.CDLL(path)
+    lib.cb_last_error.restype = ctypes.c_char_p
+    lib.cb_algo_name.restype = ctypes.c_char_p
+    lib.cb_algo_name.argtypes = [ctypes.c_int]
+    lib.cb_set_num_threads.argtypes = [ctypes.c_int]
+    lib.cb_conv_create.argtypes = [
+        ctypes.POINTER(ctypes.c_void_p), ctypes.c_char_p,
+        ctypes.POINTER(_Tensor), ctypes.POINTER(_Tensor),
+        ctypes.c_int, ctypes.c_int]
+    lib.cb_conv_output_sizes.argtypes = [
+        ctypes.c_void_p, ctypes.c_int, ctypes.c_int64 * 4]
+    lib.cb_conv_run.argtypes = [
+        ctypes.c_void_p, ctypes.POINTER(_Tensor), ctypes.POINTER(_Tensor),
+        ctypes.c_double * 2]
+    lib.cb_conv_destroy.argtypes = [ctypes.c_void_p]
+    if lib.cb_api_version() != API_VERSION:
+        raise RuntimeError('%s has API version %d, expected %d'
+                           % (path, lib.cb_api_version(), API_VERSION))
+    return lib
+
+
+_lib = _load()
+
+
+def _check(status):
+    if status != 0:
+        raise RuntimeError(_lib.cb_last_error().decode())
+
+
+def _describe(t, layout):
+    """cb_tensor for a 4-d float32 NumPy array or CPU torch tensor"""
+    if hasattr(t, 'data_ptr'):
+        if str(t.dtype) != 'torch.float32' or t.device.type != 'cpu':
+            raise TypeError('need a float32 CPU tensor')
+        ptr, sizes, strides = t.data_ptr(), tuple(t.shape), tuple(t.stride())
+    else:
+        ai = t.__array_interface__
+        if ai['typestr'] not in ('<f4', '=f4'):
+            raise TypeError('need a float32 array')
+        ptr, sizes = ai['data'][0], ai['shape']
+        if ai.get('strides'):
+            strides = tuple(s // 4 for s in ai['strides'])
+        else:
+            strides = tuple(_contiguous(sizes))
+    if len(sizes) != 4:
+        raise ValueError('need a 4-d tensor')
+    return _Tensor(ptr, (ctypes.c_int64 * 4)(*sizes),
+                   (ctypes.c_int64 * 4)(*strides), layout)
+
+
+def _contiguous(sizes):
+    ret, step = [], 1
+    for n in reversed(sizes):
+        ret.insert(0, step)
+        step *= n
+    return ret
+
+
+def algos():
+    ret, i = [], 0
+    while _lib.cb_algo_name(i):
+        ret.append(_lib.cb_algo_name(i).decode())
+        i += 1
+    return ret
+
+
+def set_num_threads(n):
+    _lib.cb_set_num_threads(n)
+
+
+class Conv(object):
+    """`algo` built for inputs shaped like x with weights w, taken as they
+    are (sparse algos keep the nonzeros); layout names the dimension order
+    of x, w and the output"""
+
+    def __init__(self, algo, x, w, stride=1, pad=1, layout=CB_NCHW):
+        self.layout = layout
+        self.handle = ctypes.c_void_p()
+        xd, wd = _describe(x, layout), _describe(w, layout)
+        xd.data = None
+        _check(_lib.cb_conv_create(ctypes.byref(self.handle), algo.encode(),
+                                   ctypes.byref(xd), ctypes.byref(wd),
+                                   stride, pad))
+        sizes = (ctypes.c_int64 * 4)()
+        _check(_lib.cb_conv_output_sizes(self.handle, layout, sizes))
+        self.out_shape = tuple(sizes)
+        self.last_ms = (0.0, 0.0)
+
+    def __call__(self, x, out=None):
+        if out is None:
+            if hasattr(x, 'data_ptr'):
+                import torch
+                out = torch.empty(self.out_shape, dtype=torch.float32)
+            else:
+                import numpy as np
+                out = np.empty(self.out_shape, dtype=np.float32)
+        ms = (ctypes.c_double * 2)()
+        xd, od = _describe(x, self.layout), _describe(out, self.layout)
+        _check(_lib.cb_conv_run(self.handle, ctypes.byref(xd),
+                                ctypes.byref(od), ms))
+        self.last_ms = (ms[0], ms[1])
+        return out
+
+    def __del__(self):
+        if getattr(self, 'handle', None):
+            _lib.cb_conv_destroy(self.handle)
+            self.handle = None
+
+
+def _read_shapes(fn):
+    with open(fn) as f:
+        lines = [l.split() for l in f if l.strip()]
+    ret = []
+    for l in lines[1:int(lines[0][0]) + 1]:
+        co, ci, kh, kw = map(int, l[:4])
+        if len(l) >= 7:
+            stride, pad, hw = map(int, l[4:7])
+        else:
+            stride, pad, hw = 1, kh // 2, 64 * 256 // co
+        ret.append((co, ci, kh, kw, stride, pad, hw))
+    return ret
+
+
+def main(argv):
+    import numpy as np
+    import torch
+    import torch.nn.functional as F
+    fmt = argv[1] if len(argv) > 1 else '../fmt.txt'
+    dat = argv[2] if len(argv) > 2 else '../dat.bin'
+    names = argv[3:] or ['NCHWMklGemmConv', 'NHWCMklGemmConv', 'NCHWMklTileConv']
+    nbatch, reps = int(os.environ.get('CB_PY_BATCH', 10)), 10
+    weights = np.fromfile(dat, dtype=np.float32)
+    offset = 0
+    torch.manual_seed(0)
+
+    def timed(fn):
+        fn()
+        best = None
+        for _ in range(reps):
+            t1 = time.time()
+            fn()
+            ms = (time.time() - t1) * 1000
+            best = ms if best is None else min(best, ms)
+        return best
+
+    for co, ci, kh, kw, stride, pad, hw in _read_shapes(fmt):
+        size = co * ci * kh * kw
+        w = torch.from_numpy(weights[offset:offset + size].reshape(co, ci, kh, kw))
+        offset += size
+        x = torch.rand(nbatch, ci, hw, hw)
+        key = '%d,%d,%d,%d,%d' % (co, hw, ci, kh, stride)
+        with torch.no_grad():
+            ref = F.conv2d(x, w, stride=stride, padding=pad)
+            ms = timed(lambda: F.conv2d(x, w, stride=stride, padding=pad))
+        print('pyconv,torch,%s,%g,0' % (key, ms))
+        for name in names:
+            try:
+                conv = Conv(name, x, w, stride, pad)
+            except RuntimeError as e:
+                print('pyconv,%s,%s,skip,%s' % (name, key, e))
+                continue
+            out = torch.empty(ref.shape)
+            ms = timed(lambda: conv(x, out))
+            err = (out - ref).abs().max().item()
+            print('pyconv,%s,%s,%g,%g' % (name, key, ms, err))
+            sys.stdout.flush()
+
+
+if __name__ == '__main__':
+    main(sys.argv)
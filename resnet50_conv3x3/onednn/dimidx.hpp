@@ -3,6 +3,7 @@
 #include <initializer_list>
 #include <type_traits>
 #include <cassert>
+#include "simd.hpp"
 
 namespace DI {
 
@@ -72,6 +73,16 @@ struct resizeCont<contTy, false> {
 };
 
 
+// struct allIntegral
+
+template <typename... Ts>
+struct allIntegral: std::true_type {};
+
+template <typename T, typename... Ts>
+struct allIntegral<T, Ts...>: std::integral_constant<bool,
+        std::is_integral<T>::value && allIntegral<Ts...>::value> {};
+
+
 // strcut DimIdx
 
 template <int Dim>
@@ -80,10 +91,12 @@ struct DimIdx {
     DimIdx<Dim-1> sub;
     const size_t stride, totalsize;
 
-    DimIdx(initializer_list<size_t> dims)
-        : DimIdx(dims.begin()) {
-        assert (dims.size() == Dim);
-    }
+    // any integer types, so int sizes need no casts under GCC and Clang,
+    // which reject narrowing them into an initializer_list<size_t>
+    template <typename... Ints, typename = typename std::enable_if<
+            sizeof...(Ints) == Dim && allIntegral<Ints...>::value>::type>
+    DimIdx(Ints... dims)
+        : DimIdx(initializer_list<size_t>{size_t(dims)...}.begin()) { }
 
     DimIdx(initializer_list<size_t>::iterator it)
         : range(*it), sub(it+1), stride(sub.totalsize), totalsize(stride * range) { }
@@ -189,6 +202,12 @@ struct Range {
     auto stepBy() -> Range<dtype, newStepLen> {
         return Range<dtype, newStepLen>(start, stop);
     }
+
+    // vector-width mode, see simd::VecRange
+    template <int unrollLen = 1>
+    auto vectorize() -> simd::VecRange<dtype, unrollLen> {
+        return simd::VecRange<dtype, unrollLen>(start, stop);
+    }
 };
 
 
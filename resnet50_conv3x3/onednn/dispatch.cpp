@@ -0,0 +1,51 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+// Entry of the multi-ISA gemm.x.  The Makefile compiles gemm.cpp once per
+// ISA with CB_ENTRY=cb_main_<isa> and localizes every other symbol of each
+// object, so the variants keep their own copies of inline functions and
+// template instances and no AVX-512 code leaks into the generic path.  The
+// widest variant the cpu supports runs; CB_ISA=<name> picks a narrower one.
+extern "C" int cb_main_generic(int argc, char **argv);
+extern "C" int cb_main_avx2(int argc, char **argv);
+extern "C" int cb_main_avx512(int argc, char **argv);
+
+static bool has_avx512() {
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+        && __builtin_cpu_supports("avx512dq") && __builtin_cpu_supports("avx512vl");
+}
+
+static bool has_avx2() {
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")
+        && __builtin_cpu_supports("f16c");
+}
+
+static bool has_sse42() { return __builtin_cpu_supports("sse4.2"); }
+
+struct Variant {
+    const char *name;
+    bool (*usable)();
+    int (*entry)(int, char**);
+};
+
+static const Variant variants[] = {
+    {"avx512", has_avx512, cb_main_avx512},
+    {"avx2", has_avx2, cb_main_avx2},
+    {"generic", has_sse42, cb_main_generic},
+};
+
+int main(int argc, char **argv) {
+    __builtin_cpu_init();
+    const char *want = std::getenv("CB_ISA");
+    for (auto &v: variants) {
+        if (want && *want && std::strcmp(want, v.name)) continue;
+        if (!v.usable()) {
+            if (want && *want) std::cerr << "CB_ISA=" << want << " not supported here" << std::endl;
+            continue;
+        }
+        return v.entry(argc, argv);
+    }
+    std::cerr << "no usable kernel variant" << std::endl;
+    return 1;
+}
@@ -0,0 +1,254 @@
+#ifndef _FUSED_HPP_
+#define _FUSED_HPP_
+#include "testbed.hpp"
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <unistd.h>
+#include <mkl.h>
+
+// Cross-layer fusion of runs of identical 3x3, stride 1, pad 1, C -> C
+// layers.  A group of `depth` layers is computed per T x T output tile:
+// the tile's input plus a halo of depth pixels is copied into a per-thread
+// buffer, and every layer of the group is applied to the shrinking region
+// in place of the next, recomputing the halo overlap of neighbouring
+// tiles, so only the group's input and output pass through DRAM.
+//
+// A region of Ci channels keeps the level-0 row pitch Wp = T + 2 * depth
+// at every level, which turns each of the 9 taps into one GEMM over the
+// flattened rows, (C x C) taps times the input shifted by kh * Wp + kw;
+// the columns past a level's width come out as don't-care values that no
+// valid output reads.  Positions outside the image are zeroed after each
+// level so they act as the next layer's padding.
+namespace fuse {
+
+inline bool fusable(const ConvShape &s) {
+    return s.Kh == 3 && s.Kw == 3 && s.stride == 1 && s.pad == 1 && s.Ci == s.Co;
+}
+
+// whether b can run fused after a
+inline bool chains(const ConvShape &a, const ConvShape &b) {
+    return fusable(a) && fusable(b) && a.Co == b.Ci && a.HW == b.HW;
+}
+
+struct Plan {
+    int depth, tile;
+    double cost;  // MAC-equivalents per layer and image
+};
+
+inline std::size_t l2_bytes() {
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    return env_or("CB_FUSE_L2", l2 > 0 ? std::size_t(l2) : std::size_t(1) << 20);
+}
+
+// Roofline-style estimate for one layer of a depth-D group at tile T:
+// MACs including halo recompute and the pitch columns, plus CB_FUSE_BALANCE
+// (default 8) MACs for every byte moved to or from DRAM, which is the
+// group's input with halos and its output, amortized over D layers, and
+// the weights once per tile unless the group's weights stay in L2 next
+// to the tile buffers.  Tile counts below the thread count leave cores
+// idle and are charged for it.  Fused groups (D > 1) must keep both tile
+// buffers in L2.
+inline Plan estimate(const ConvShape &s, int N, int depth, int tile) {
+    double balance = env_or("CB_FUSE_BALANCE", 8.0);
+    double C = s.Ci, HW = s.HW, T = std::min(tile, s.HW), pitch = T + 2 * depth;
+    double macs = 0;
+    for (int l = 1; l <= depth; l++) macs += 9 * C * C * (T + 2 * (depth - l)) * pitch;
+    double ntiles = std::ceil(HW / T) * std::ceil(HW / T);
+    macs *= ntiles / depth;
+    double bufbytes = 2 * 4 * C * pitch * pitch, wbytes = depth * 9 * C * C * 4;
+    double act = 4 * C * (ntiles * pitch * pitch + HW * HW) / depth;
+    double wtraffic = bufbytes + wbytes <= l2_bytes() ? wbytes / N : wbytes * ntiles;
+    double cost = macs + balance * (act + wtraffic / depth);
+    int nt = numa::max_threads();
+    cost *= double(nt) / std::min<double>(nt, N * ntiles);
+    if (depth > 1 && bufbytes > l2_bytes()) cost = INFINITY;
+    return {depth, std::min(tile, s.HW), cost};
+}
+
+// cheapest (depth, tile) for layers like s with at most maxdepth in a row,
+// tiles being powers of two up to the whole image
+inline Plan best_plan(const ConvShape &s, int N, int maxdepth) {
+    Plan best = estimate(s, N, 1, s.HW);
+    for (int d = 1; d <= maxdepth; d++)
+        for (int t = 4; t < 2 * s.HW; t *= 2) {
+            auto p = estimate(s, N, d, t);
+            if (p.cost < best.cost) best = p;
+        }
+    return best;
+}
+
+
+class Group {
+    int N, C, HW, D, T, Wp;
+    std::size_t cstride, slab;
+    tensor_t taps;  // per layer (kh, kw, F, C)
+    tensor_t work;  // per thread, two buffers of C x cstride
+
+    // level l of the tile at (oh0, ow0): src holds the region l - 1 with
+    // its corner at (oh0 - D + l - 1, ow0 - D + l - 1), dst gets region l
+    void level(int l, int th, int tw, int oh0, int ow0, const float *src, float *dst) {
+        int r = D - l, ho = th + 2 * r, wo = tw + 2 * r;
+        const float *w = taps.data() + std::size_t(l - 1) * 9 * C * C;
+        int ncols = (ho - 1) * Wp + wo;
+        for (int k = 0; k < 9; k++)
+            cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+                    C, ncols, C, 1, w + std::size_t(k) * C * C, C,
+                    src + k / 3 * Wp + k % 3, cstride,
+                    k ? 1 : 0, dst, cstride);
+        if (l == D) return;
+        for (int c = 0; c < C; c++)
+            for (int y = 0; y < ho; y++) {
+                float *row = dst + c * cstride + y * Wp;
+                int ih = oh0 - r + y;
+                if (ih < 0 || ih >= HW) {
+                    std::fill(row, row + wo, 0.0f);
+                    continue;
+                }
+                for (int x = 0; x < wo; x++) {
+                    int iw = ow0 - r + x;
+                    if (iw < 0 || iw >= HW) row[x] = 0;
+                }
+            }
+    }
+
+public:
+    // weights[l] in (F, C, K, K), one per layer of the group
+    Group(int N, const ConvShape &s, const Plan &plan,
+          const std::vector<const tensor_t*> &weights)
+        : N(N), C(s.Ci), HW(s.HW), D(plan.depth), T(plan.tile),
+          Wp(plan.tile + 2 * plan.depth) {
+        cstride = std::size_t(Wp) * Wp;
+        slab = 2 * C * cstride;
+        taps.resize(std::size_t(D) * 9 * C * C);
+        for (int l = 0; l < D; l++)
+            for (int f = 0; f < C; f++)
+                for (int c = 0; c < C; c++)
+                    for (int k = 0; k < 9; k++)
+                        taps[((std::size_t(l) * 9 + k) * C + f) * C + c] =
+                            (*weights[l])[(std::size_t(f) * C + c) * 9 + k];
+        work.resize(numa::max_threads() * slab);
+    }
+
+    int depth() const { return D; }
+    int tile() const { return T; }
+
+    // in and out are N x C x HW x HW
+    void run(const float *in, float *out) {
+        int nth = (HW + T - 1) / T, ntiles = nth * nth;
+        #pragma omp parallel
+        {
+            TRACE_SCOPE("fused_group");
+            mkl_set_num_threads_local(1);
+            float *buf[2] = {work.data() + omp_get_thread_num() * slab, nullptr};
+            buf[1] = buf[0] + C * cstride;
+            #pragma omp for schedule(dynamic) nowait
+            for (int it = 0; it < N * ntiles; it++) {
+                int n = it / ntiles, oh0 = it % ntiles / nth * T, ow0 = it % nth * T;
+                int th = std::min(T, HW - oh0), tw = std::min(T, HW - ow0);
+                int hi = th + 2 * D, wi = tw + 2 * D;
+                for (int c = 0; c < C; c++) {
+                    const float *plane = in + (std::size_t(n) * C + c) * HW * HW;
+                    for (int y = 0; y < hi; y++) {
+                        float *row = buf[0] + c * cstride + y * Wp;
+                        int ih = oh0 - D + y;
+                        for (int x = 0; x < wi; x++) {
+                            int iw = ow0 - D + x;
+                            row[x] = ih >= 0 && ih < HW && iw >= 0 && iw < HW
+                                   ? plane[ih * HW + iw] : 0;
+                        }
+                    }
+                }
+                for (int l = 1; l <= D; l++)
+                    level(l, th, tw, oh0, ow0, buf[(l - 1) % 2], buf[l % 2]);
+                const float *res = buf[D % 2];
+                for (int c = 0; c < C; c++)
+                    for (int y = 0; y < th; y++)
+                        std::copy(res + c * cstride + y * Wp,
+                                  res + c * cstride + y * Wp + tw,
+                                  out + ((std::size_t(n) * C + c) * HW + oh0 + y) * HW + ow0);
+            }
+            mkl_set_num_threads_local(0);
+        }
+    }
+};
+
+
+// CB_FUSE=1: every run of chainable layers of at least two is planned with
+// the cost model (at most CB_FUSE_DEPTH, default 4, layers per group) and
+// executed fused, chained from the input batch.  Prints the plan as
+//   fuseplan,first,len,depth,tile,cost/unfused_cost
+// then a conv line per pass, impl d<depth>t<tile>, and a summary
+//   fuse,first,len,fused_ms,layered_ms,relerr
+// against the same layers run one by one with NCHWMklGemmConv, whose
+// layered_ms is one warm im2col + GEMM pass per layer.
+inline void fused_bench(const std::vector<ConvShape> &shapes,
+                        const std::vector<tensor_t> &weights,
+                        const tensor_t &indata, int N, int repeat_cnt) {
+    int maxdepth = std::max(1, env_or("CB_FUSE_DEPTH", 4));
+    for (std::size_t first = 0, len; first < shapes.size(); first += len) {
+        for (len = 1; first + len < shapes.size()
+                      && chains(shapes[first + len - 1], shapes[first + len]); len++) {}
+        if (len < 2) continue;
+        auto &s = shapes[first];
+        std::vector<std::unique_ptr<Group>> groups;
+        for (std::size_t l = 0; l < len; ) {
+            auto plan = best_plan(s, N, std::min<int>(maxdepth, len - l));
+            std::cout << "fuseplan," << first + l << ',' << len - l << ',' << plan.depth
+                      << ',' << plan.tile << ','
+                      << plan.cost / estimate(s, N, 1, s.HW).cost << std::endl;
+            std::vector<const tensor_t*> ws;
+            for (int d = 0; d < plan.depth; d++) ws.push_back(&weights[first + l + d]);
+            groups.emplace_back(new Group(N, s, plan, ws));
+            l += plan.depth;
+        }
+
+        std::size_t size = std::size_t(N) * s.Ci * s.HW * s.HW;
+        tensor_t in(indata.begin(), indata.begin() + size), tmp(size), out(size);
+        auto pass = [&] {
+            const float *src = in.data();
+            for (std::size_t g = 0; g < groups.size(); g++) {
+                float *dst = (groups.size() - g) % 2 ? out.data() : tmp.data();
+                groups[g]->run(src, dst);
+                src = dst;
+            }
+        };
+        pass();
+        double fused_ms = 0;
+        for (int r = 0; r < repeat_cnt; r++) {
+            auto t1 = steady_clock::now();
+            pass();
+            double ms = time_diff(steady_clock::now(), t1) * 1000;
+            fused_ms = r ? std::min(fused_ms, ms) : ms;
+            std::cout << "conv,NCHW,fused,";
+            for (auto &g: groups) std::cout << 'd' << g->depth() << 't' << g->tile();
+            std::cout << ",none,0," << s.Co << ',' << s.HW << ',' << s.Ci
+                      << ",3,1,0," << ms << std::endl;
+        }
+
+        tensor_t ref = in;
+        double layered_ms = 0;
+        for (std::size_t l = 0; l < len; l++) {
+            CaseProvider cp(ref, {N, s.Ci, s.HW, s.HW}, weights[first + l],
+                            {s.Co, s.Ci, 3, 3}, 1, 1);
+            auto conv = cp.newConv<NCHWMklGemmConv>();
+            conv->run();
+            auto times = conv->run();
+            layered_ms += times.first + times.second;
+            ref = conv->get_result();
+        }
+        double err = 0, norm = 0;
+        for (std::size_t i = 0; i < size; i++) {
+            err += (out[i] - ref[i]) * double(out[i] - ref[i]);
+            norm += ref[i] * double(ref[i]);
+        }
+        std::cout << "fuse," << first << ',' << len << ',' << fused_ms
+                  << ',' << layered_ms << ',' << std::sqrt(err / std::max(norm, 1e-30))
+                  << std::endl;
+    }
+}
+
+}  // end namespace
+
+#endif  // _FUSED_HPP_
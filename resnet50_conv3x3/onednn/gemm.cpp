@@ -5,46 +5,211 @@
 #include "dimidx.hpp"
 #include "tensorutils.hpp"
 #include "testbed.hpp"
+#include "registry.hpp"
+#include "streams.hpp"
+#include "fused.hpp"
+#include "compare.hpp"
+#include "trace.hpp"
+#include "prof.hpp"
+#include "memstat.hpp"
+#include "wcache.hpp"
+#include "wfile.hpp"
+#include "numa.hpp"
 
 
-int main() {
-    std::ifstream infmt("../fmt.txt");
-    std::ifstream weightfile("../dat.bin", std::ios::binary);
-    int cnt_data_sets; infmt >> cnt_data_sets;
-    int nbatch = 10;
-    tensor_t indata(nbatch * 64 * 256 * 256);
+// each run reports the footprint measured by mem, opened before the conv
+// was created, once its result is out.  A plain copy of the NCHW result is
+// the benchmark's and stays out; the buffer other layouts convert into
+// counts, see converts_result.
+template <typename ConvPtr>
+tensor_t run_dense(ConvPtr conv, int repeat_cnt, const memstat::Scope &mem) {
+    for (auto r: Range<>(0, repeat_cnt))
+        conv->compute();
+    auto u = mem.usage();
+    auto ret = conv->get_result();
+    if (conv->converts_result()) u = mem.usage();
+    conv->report_memory(u);
+    return ret;
+}
+
+template <typename ConvPtr>
+void run_sparse(ConvPtr conv, int repeat_cnt, const memstat::Scope &mem) {
+    for (auto i: Range<>(0, 5)) {
+        conv->sparsity(0.35 + i * 0.15);
+        for (auto r: Range<>(0, repeat_cnt))
+            conv->compute();
+        conv->report_memory(mem.usage());
+    }
+}
+
+// warms up, then reports p50/p99 of reps single passes
+template <typename ConvClass>
+void bench_latency(CaseProvider &cp, int reps) {
+    memstat::Scope mem;
+    auto conv = cp.newConv<ConvClass>();
+    conv->run();
+    std::vector<double> samples;
+    for (auto r: Range<>(0, reps)) {
+        auto times = conv->run();
+        samples.push_back(times.first + times.second);
+    }
+    conv->report_latency(samples);
+    conv->report_memory(mem.usage());
+}
+
+// backward classes also print the diff against their naive reference()
+template <typename ConvPtr>
+void run_backward(ConvPtr conv, int repeat_cnt, const memstat::Scope &mem) {
+    auto ret = run_dense(conv.get(), repeat_cnt, mem);
+    auto ref = conv->reference();
+    std::cout << "diff," << square_diff(ret, ref) << std::endl;
+}
+
+// CB_NUMA=2 runs every class split per node, see numa.hpp
+template <typename ConvClass>
+tensor_t bench(CaseProvider &cp, int repeat_cnt) {
+    memstat::Scope mem;
+    if (numa::mode() == numa::SPLIT)
+        return run_dense(cp.newSplitConv<ConvClass>(), repeat_cnt, mem);
+    return run_dense(cp.newConv<ConvClass>(), repeat_cnt, mem);
+}
+
+template <typename ConvClass>
+void bench_sparse(CaseProvider &cp, int repeat_cnt) {
+    memstat::Scope mem;
+    if (numa::mode() == numa::SPLIT)
+        run_sparse(cp.newSplitConv<ConvClass>(), repeat_cnt, mem);
+    else
+        run_sparse(cp.newConv<ConvClass>(), repeat_cnt, mem);
+}
+
+template <typename ConvClass>
+void bench_backward(CaseProvider &cp, int repeat_cnt) {
+    memstat::Scope mem;
+    if (numa::mode() == numa::SPLIT)
+        run_backward(cp.newSplitConv<ConvClass>(), repeat_cnt, mem);
+    else
+        run_backward(cp.newConv<ConvClass>(), repeat_cnt, mem);
+}
+
+int bench_main(int argc, char **argv) {
+    BaselineCompare baseline;
+    // which build of the kernels runs, on which host ISA
+    std::cout << "variant," << simd::variant() << ',' << isa_tag() << std::endl;
+    std::ifstream infmt(argc > 1 ? argv[1] : "../fmt.txt");
+    // raw fp32 or a .cbw file from wconvert.x, see wfile.hpp
+    std::ifstream weightfile(argc > 2 ? argv[2] : "../dat.bin", std::ios::binary);
+    wfile::WeightReader wreader(weightfile);
+    auto shapes = read_shapes(infmt);
+    if (numa::mode() != numa::OFF) numa::pin_threads();
+    // CB_LATENCY=1: batch 1, single-request latency of the dense classes
+    bool latency = env_or("CB_LATENCY", 0) != 0;
+    int nbatch = latency ? 1 : 10;
+    std::size_t maxin = 0;
+    for (auto &s: shapes) maxin = std::max(maxin, s.insize());
+    tensor_t indata(nbatch * maxin);
     init_rand(indata);
-    for (auto i: Range<>(0, cnt_data_sets)) {
-        int Co, Ci, Kh, Kw; infmt >> Co >> Ci >> Kh >> Kw;
-        DimIdx<4> dWeight {Co, Ci, Kh, Kw};
-        tensor_t weight(dWeight.totalsize);
-        read_binary(weightfile, weight);
-        int HW = 64 * 256 / Co;
-        CaseProvider cp(indata, {nbatch, Ci, HW, HW}, weight, dWeight);
-        tensor_t ret1, ret2;
+    std::unique_ptr<WeightCache> wcache;
+    auto wcdir = env_or("CB_WCACHE", "");
+    if (!wcdir.empty()) wcache.reset(new WeightCache(wcdir));
+    // CB_SELECT=<file> runs each layer only with the implementation picked
+    // by AlgoSelector, dense and at run_sparse's sparsities
+    std::unique_ptr<AlgoSelector> selector;
+    auto selpath = env_or("CB_SELECT", "");
+    if (!selpath.empty()) selector.reset(new AlgoSelector(selpath));
+    // whole-sequence modes, CB_FUSE (fused.hpp) and CB_STREAMS (streams.hpp),
+    // read every layer's weights up front and replace the per-layer runs
+    bool fuse = env_or("CB_FUSE", 0) != 0, streams = !env_or("CB_STREAMS", "").empty();
+    if (fuse || streams) {
+        std::vector<tensor_t> weights(shapes.size());
+        for (std::size_t l = 0; l < shapes.size(); l++)
+            if (!wreader.next(shapes[l], weights[l])) return 1;
+        if (fuse) fuse::fused_bench(shapes, weights, indata, nbatch, 10);
+        if (streams) stream_sweep(shapes, weights, indata, nbatch);
+        return baseline.finish();
+    }
+    for (auto &s: shapes) {
+        DimIdx<4> dWeight {s.Co, s.Ci, s.Kh, s.Kw};
+        tensor_t weight;
+        if (!wreader.next(s, weight)) return 1;
+        CaseProvider cp(indata, {nbatch, s.Ci, s.HW, s.HW}, weight, dWeight,
+                        s.stride, s.pad, wcache.get());
         int repeat_cnt = 10;
-        {
-            auto nchw = cp.newConv<NCHWMklGemmConv>();
-            for (auto r: Range<>(0, repeat_cnt))
-                nchw->compute();
-            ret1 = nchw->get_result();
+        if (latency) {
+            int reps = env_or("CB_LATENCY_REPS", 100);
+            bench_latency<NCHWDirectConv>(cp, reps);
+            bench_latency<NCHWMklGemmConv>(cp, reps);
+            bench_latency<NHWCMklGemmConv>(cp, reps);
+            bench_latency<NCHWMklTileConv>(cp, reps);
+            bench_latency<NCHWMklSplitKConv>(cp, reps);
+            continue;
+        }
+        // CB_ACT_SPARSE=<sparsities>: dense GEMM against NCHWActSparseConv on
+        // inputs with that fraction of zeros, in runs of CB_ACT_BLOCK
+        auto actsp = env_or("CB_ACT_SPARSE", "");
+        if (!actsp.empty()) {
+            std::istringstream is(actsp);
+            tensor_t sparse(indata.size());
+            float sp;
+            while (is >> sp) {
+                is.ignore(1, ',');
+                init_sparse(sparse, sp, std::max(1, env_or("CB_ACT_BLOCK", 1)));
+                CaseProvider scp(sparse, {nbatch, s.Ci, s.HW, s.HW}, weight, dWeight,
+                                 s.stride, s.pad, wcache.get());
+                std::cout << "input_sparsity," << sp << std::endl;
+                auto ret1 = bench<NCHWMklGemmConv>(scp, repeat_cnt);
+                auto ret2 = bench<NCHWActSparseConv>(scp, repeat_cnt);
+                std::cout << "diff," << square_diff(ret1, ret2) << std::endl;
+            }
+            continue;
         }
-        {
-            auto nhwc = cp.newConv<NHWCMklGemmConv>();
-            for (auto r: Range<>(0, repeat_cnt))
-                nhwc->compute();
-            ret2 = nhwc->get_result();
+        if (selector) {
+            // trials stay out of the footprint
+            auto run_selected = [&] (float sp) {
+                auto &algo = selector->select(nbatch, s, sp, cp);
+                memstat::Scope mem;
+                run_dense(algo.create(cp, sp), repeat_cnt, mem);
+            };
+            run_selected(0);
+            for (auto i: Range<>(0, 5))
+                run_selected(0.35 + i * 0.15);
+            continue;
         }
+        auto ret1 = bench<NCHWMklGemmConv>(cp, repeat_cnt);
+        auto ret2 = bench<NHWCMklGemmConv>(cp, repeat_cnt);
         float diff = square_diff(ret1, ret2);
         std::cout << "diff," << diff << std::endl;
-        {
-            auto nchwcsr = cp.newConv<NCHWMklSpGemmConv>();
-            for (auto i: Range<>(0, 5)) {
-                nchwcsr->sparsity(0.35 + i * 0.15);
-                for (auto r: Range<>(0, repeat_cnt))
-                    nchwcsr->compute();
-            }
-        }
+        auto ret3 = bench<NHWCnDirectConv>(cp, repeat_cnt);
+        std::cout << "diff," << square_diff(ret1, ret3) << std::endl;
+        auto ret4 = bench<NCHWMklSplitKConv>(cp, repeat_cnt);
+        std::cout << "diff," << square_diff(ret1, ret4) << std::endl;
+        // packed panels may come from wcache, see wcache.hpp
+        auto ret5 = bench<NCHWMklPackGemmConv>(cp, repeat_cnt);
+        std::cout << "diff," << square_diff(ret1, ret5) << std::endl;
+        auto ret6 = bench<NHWCMklPackGemmConv>(cp, repeat_cnt);
+        std::cout << "diff," << square_diff(ret1, ret6) << std::endl;
+        auto ret7 = bench<NCHWMklPipeGemmConv>(cp, repeat_cnt);
+        std::cout << "diff," << square_diff(ret1, ret7) << std::endl;
+        bench_sparse<NCHWMklSpGemmConv>(cp, repeat_cnt);
+        bench_backward<NCHWMklBwdDataConv>(cp, repeat_cnt);
+        // NumaSplitConv concatenates per-node results, while weight
+        // gradients would have to be summed, so this one never splits
+        memstat::Scope mem;
+        run_backward(cp.newConv<NCHWMklBwdWeightConv>(), repeat_cnt, mem);
     }
-    return 0;
+    trace::dump(env_or("CB_TRACE_FILE", "trace.json"));
+    prof::profiler().dump();
+    return baseline.finish();
+}
+
+// The multi-ISA gemm.x links one copy of this file per ISA, each with its
+// symbols made local but for its entry point, see dispatch.cpp.
+#ifdef CB_ENTRY
+extern "C" int CB_ENTRY(int argc, char **argv) {
+    return bench_main(argc, argv);
+}
+#else
+int main(int argc, char **argv) {
+    return bench_main(argc, argv);
 }
+#endif
@@ -0,0 +1,65 @@
+#ifndef _MEMSTAT_HPP_
+#define _MEMSTAT_HPP_
+#include <atomic>
+#include <cstddef>
+#include <sys/resource.h>
+
+// Footprint accounting for tensor_t, whose allocator reports every
+// allocation and release here.  A Scope measures from its construction:
+// bytes allocated, peak live bytes above what was live at the start, and
+// the page faults of the whole process (getrusage), which also catch what
+// MKL allocates on its own.  Scopes reset the shared peak, so they must
+// not nest or overlap.
+namespace memstat {
+
+struct Counters {
+    std::atomic<std::size_t> allocated, live, peak;
+};
+
+inline Counters &counters() {
+    static Counters ret {{0}, {0}, {0}};
+    return ret;
+}
+
+inline void on_alloc(std::size_t bytes) {
+    auto &c = counters();
+    c.allocated += bytes;
+    auto cur = c.live += bytes;
+    auto peak = c.peak.load(std::memory_order_relaxed);
+    while (cur > peak && !c.peak.compare_exchange_weak(peak, cur)) {}
+}
+
+inline void on_free(std::size_t bytes) {
+    counters().live -= bytes;
+}
+
+struct Usage {
+    std::size_t allocated, peak;
+    long minflt, majflt;
+};
+
+class Scope {
+    std::size_t allocated, live;
+    rusage ru;
+
+public:
+    Scope() {
+        auto &c = counters();
+        allocated = c.allocated;
+        live = c.live;
+        c.peak.store(live);
+        getrusage(RUSAGE_SELF, &ru);
+    }
+
+    Usage usage() const {
+        auto &c = counters();
+        rusage now;
+        getrusage(RUSAGE_SELF, &now);
+        return {c.allocated - allocated, c.peak > live ? c.peak - live : 0,
+                now.ru_minflt - ru.ru_minflt, now.ru_majflt - ru.ru_majflt};
+    }
+};
+
+}  // end namespace
+
+#endif  // _MEMSTAT_HPP_
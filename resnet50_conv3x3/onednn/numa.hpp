@@ -0,0 +1,304 @@
+#ifndef _NUMA_HPP_
+#define _NUMA_HPP_
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sched.h>
+#include "memstat.hpp"
+#include "trace.hpp"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// CB_NUMA selects the NUMA mode:
+//   0  (default) buffers are zeroed by the allocating thread, no pinning
+//   1  buffers are first-touched by the OpenMP team in static chunks, the
+//      same partition the kernels' `omp parallel for` loops use, and the
+//      team is pinned node by node, physical cores first
+//   2  as 1, and the benchmarks split the batch across nodes, each node
+//      running its own instance with replicated weights on a local team
+// Without /sys/devices/system/node everything runs as a single node.
+namespace numa {
+
+enum Mode { OFF = 0, TOUCH = 1, SPLIT = 2 };
+
+inline int mode() {
+    static int val = [] {
+        const char *s = std::getenv("CB_NUMA");
+        return (s && *s) ? std::atoi(s) : 0;
+    }();
+    return val;
+}
+
+inline std::vector<int> parse_cpulist(const std::string &str) {
+    std::vector<int> ret;
+    std::istringstream is(str);
+    std::string item;
+    while (std::getline(is, item, ',')) {
+        if (item.empty() || item == "\n") continue;
+        int lo = std::atoi(item.c_str()), hi = lo;
+        auto dash = item.find('-');
+        if (dash != std::string::npos) hi = std::atoi(item.c_str() + dash + 1);
+        for (int c = lo; c <= hi; c++) ret.push_back(c);
+    }
+    return ret;
+}
+
+inline std::string read_line(const std::string &fn) {
+    std::ifstream is(fn);
+    std::string ret;
+    std::getline(is, ret);
+    return ret;
+}
+
+struct Node {
+    std::vector<int> cpus;  // physical cores first, then their siblings
+    int cores;
+};
+
+inline Node make_node(const std::vector<int> &cpus, const cpu_set_t &allowed) {
+    std::vector<int> first, rest;
+    for (int cpu: cpus) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        auto sib = parse_cpulist(read_line("/sys/devices/system/cpu/cpu"
+                + std::to_string(cpu) + "/topology/thread_siblings_list"));
+        (sib.empty() || sib[0] == cpu ? first : rest).push_back(cpu);
+    }
+    int cores = first.size();
+    first.insert(first.end(), rest.begin(), rest.end());
+    return Node {first, cores};
+}
+
+// nodes with usable cpus, memory-only nodes skipped
+inline const std::vector<Node> &nodes() {
+    static std::vector<Node> ret = [] {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        sched_getaffinity(0, sizeof(allowed), &allowed);
+        std::vector<Node> ret;
+        for (int id = 0; ; id++) {
+            auto fn = "/sys/devices/system/node/node" + std::to_string(id)
+                    + "/cpulist";
+            if (!std::ifstream(fn)) break;
+            auto node = make_node(parse_cpulist(read_line(fn)), allowed);
+            if (!node.cpus.empty()) ret.push_back(node);
+        }
+        if (ret.empty()) {
+            std::vector<int> all;
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) all.push_back(cpu);
+            ret.push_back(make_node(all, allowed));
+        }
+        return ret;
+    }();
+    return ret;
+}
+
+inline void pin_to(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+}
+
+inline int max_threads() {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// Pins the calling thread's OpenMP team, thread i to cpus[i % size].
+inline void pin_team(const std::vector<int> &cpus, int nthreads) {
+#ifdef _OPENMP
+    #pragma omp parallel num_threads(nthreads)
+    pin_to(cpus[omp_get_thread_num() % cpus.size()]);
+#else
+    pin_to(cpus[0]);
+#endif
+}
+
+// All cpus as the main team uses them: physical cores node by node, then
+// siblings, so thread blocks of a static schedule stay on one socket.
+inline std::vector<int> compact_cpus() {
+    std::vector<int> cpus, rest;
+    for (auto &node: nodes()) {
+        cpus.insert(cpus.end(), node.cpus.begin(), node.cpus.begin() + node.cores);
+        rest.insert(rest.end(), node.cpus.begin() + node.cores, node.cpus.end());
+    }
+    cpus.insert(cpus.end(), rest.begin(), rest.end());
+    return cpus;
+}
+
+// the cpus of the PinnedTeam the calling thread is the master of, if any
+inline const std::vector<int> *&current_team() {
+    static thread_local const std::vector<int> *cpus = nullptr;
+    return cpus;
+}
+
+// The cpus the caller's team runs on, in its order: those of the node or
+// stream team it was submitted to, else the main team's.
+inline std::vector<int> team_cpus() {
+    auto cpus = current_team();
+    return cpus ? *cpus : compact_cpus();
+}
+
+inline void pin_threads() {
+    pin_team(compact_cpus(), max_threads());
+}
+
+// Zero-fills a fresh allocation.  From mode 1 on each thread of the team
+// touches its static chunk, placing the pages where that thread computes.
+inline void first_touch(void *ptr, std::size_t bytes) {
+    auto p = (char*) ptr;
+#ifdef _OPENMP
+    if (mode() != OFF && bytes >= (1 << 20)) {
+        #pragma omp parallel
+        {
+            TRACE_SCOPE("first_touch");
+            std::size_t nt = omp_get_num_threads(), t = omp_get_thread_num();
+            std::size_t chunk = (bytes + nt - 1) / nt;
+            std::size_t b = std::min(bytes, t * chunk);
+            std::size_t e = std::min(bytes, b + chunk);
+            std::memset(p + b, 0, e - b);
+        }
+        return;
+    }
+#endif
+    std::memset(p, 0, bytes);
+}
+
+
+// A worker thread owning its own OpenMP team pinned to `cpus`.  OpenMP
+// keeps a thread pool per native master thread, so the pinning sticks for
+// every parallel region and MKL call issued from jobs run on the team.
+class PinnedTeam {
+    std::vector<int> cpus;
+    int nthreads;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::function<void()> job;
+    bool quit;
+    std::thread worker;
+
+    void loop() {
+        current_team() = &cpus;
+        pin_to(cpus[0]);
+#ifdef _OPENMP
+        omp_set_num_threads(nthreads);
+#endif
+        pin_team(cpus, nthreads);
+        std::unique_lock<std::mutex> lk(mtx);
+        while (true) {
+            cv.wait(lk, [this] { return quit || job; });
+            if (!job) return;
+            lk.unlock();
+            job();
+            lk.lock();
+            job = nullptr;
+            cv.notify_all();
+        }
+    }
+
+public:
+    PinnedTeam(const std::vector<int> &cpus, int nthreads)
+        : cpus(cpus), nthreads(std::max(1, nthreads)), quit(false),
+          worker(&PinnedTeam::loop, this) {}
+
+    ~PinnedTeam() {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            quit = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    int size() const { return nthreads; }
+
+    void submit(std::function<void()> fn) {
+        std::unique_lock<std::mutex> lk(mtx);
+        cv.wait(lk, [this] { return !job; });
+        job = std::move(fn);
+        cv.notify_all();
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> lk(mtx);
+        cv.wait(lk, [this] { return !job; });
+    }
+
+    void run(std::function<void()> fn) {
+        submit(std::move(fn));
+        wait();
+    }
+};
+
+// one team per node sharing the OpenMP thread budget, created on first use
+inline std::vector<std::unique_ptr<PinnedTeam>> &node_teams() {
+    static std::vector<std::unique_ptr<PinnedTeam>> teams = [] {
+        std::vector<std::unique_ptr<PinnedTeam>> ret;
+        int per = std::max(1, max_threads() / (int) nodes().size());
+        for (auto &node: nodes())
+            ret.emplace_back(new PinnedTeam(node.cpus, per));
+        return ret;
+    }();
+    return teams;
+}
+
+}  // end namespace
+
+
+// Allocator behind tensor_t: 64-byte aligned, zeroed by first_touch and
+// counted by memstat.  Elements are still value-initialized as in any
+// vector, so a tail regrown after a shrink reads as zero; the pages stay
+// where first_touch placed them.
+template <typename T>
+struct FirstTouchAllocator {
+    typedef T value_type;
+
+    FirstTouchAllocator() {}
+    template <typename U>
+    FirstTouchAllocator(const FirstTouchAllocator<U>&) {}
+
+    T *allocate(std::size_t n) {
+        void *ptr = nullptr;
+        if (posix_memalign(&ptr, 64, std::max<std::size_t>(1, n * sizeof(T))))
+            throw std::bad_alloc();
+        memstat::on_alloc(n * sizeof(T));
+        numa::first_touch(ptr, n * sizeof(T));
+        return (T*) ptr;
+    }
+
+    void deallocate(T *ptr, std::size_t n) {
+        memstat::on_free(n * sizeof(T));
+        std::free(ptr);
+    }
+
+    template <typename U, typename... Args>
+    void construct(U *ptr, Args&&... args) {
+        ::new((void*) ptr) U(std::forward<Args>(args)...);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const FirstTouchAllocator<T>&, const FirstTouchAllocator<U>&) {
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const FirstTouchAllocator<T>&, const FirstTouchAllocator<U>&) {
+    return false;
+}
+
+#endif  // _NUMA_HPP_
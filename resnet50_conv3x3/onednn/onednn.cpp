@@ -3,8 +3,12 @@
 #include <fstream>
 #include <iostream>
 #include <random>
+#include <memory>
+#include <sstream>
 #include <dnnl.hpp>
 #include "tensorutils.hpp"
+#include "wcache.hpp"
+#include "compare.hpp"
 using namespace dnnl;
 
 typedef std::unordered_map<int, memory> primargs_t;
@@ -27,28 +31,64 @@ struct runner {
     using tag = memory::format_tag;
     using dt = memory::data_type;
 
-    std::vector<std::pair<primitive, primargs_t>> prims;
+    // one primitive per distinct shape; layers repeating a shape share it
+    // along with its activations, which only depend on the shape here
+    struct ConvEntry {
+        convolution_forward::primitive_desc pd;
+        convolution_forward prim;
+        memory src, bias, dst;
+    };
+
+    struct Layer {
+        ConvShape shape;
+        primitive prim;
+        primargs_t args;
+        std::string impl;
+    };
+
+    std::unordered_map<std::string, ConvEntry> convs;
+    std::unordered_map<std::string, memory> wmems;  // shape key + src hash
+    std::vector<Layer> layers;
     engine eng;
     stream st;
+    WeightCache *wcache;
 
-    runner(): eng(engine::kind::cpu, 0), st(eng) { }
+    runner(WeightCache *wcache = nullptr)
+        : eng(engine::kind::cpu, 0), st(eng), wcache(wcache) { }
 
-    void test_conv(int N, int C, int HW,
-            const tensor_t &weights, const tensor_t &image) {
-        memory::dims src_tz = {N, C, HW, HW};
-        memory::dims weights_tz = {C, C, 3, 3};
-        memory::dims bias_tz = {C};
-        memory::dims dst_tz = {N, C, HW, HW};
-        memory::dims strides = {1, 1};
-        memory::dims padding = {1, 1};
+    static std::string shape_key(int N, const ConvShape &s) {
+        std::ostringstream os;
+        os << 'N' << N << 'C' << s.Ci << 'H' << s.HW << 'F' << s.Co
+           << 'K' << s.Kh << 'S' << s.stride << 'P' << s.pad;
+        return os.str();
+    }
+
+    std::string cache_key(int N, const ConvShape &s,
+            const convolution_forward::primitive_desc &pd) {
+        auto v = dnnl_version();
+        std::ostringstream os;
+        os << "onednn-" << pd.impl_info_str()
+           << "-N" << N << 'C' << s.Ci << 'H' << s.HW << 'F' << s.Co
+           << 'K' << s.Kh << 'S' << s.stride << 'P' << s.pad << 'W' << s.HW
+           << '-' << isa_tag() << "-dnnl" << v->major << '.' << v->minor
+           << '.' << v->patch;
+        return os.str();
+    }
+
+    ConvEntry make_conv(int N, const ConvShape &s, const tensor_t &image) {
+        int OHW = s.outsize();
+        memory::dims src_tz = {N, s.Ci, s.HW, s.HW};
+        memory::dims weights_tz = {s.Co, s.Ci, s.Kh, s.Kw};
+        memory::dims bias_tz = {s.Co};
+        memory::dims dst_tz = {N, s.Co, OHW, OHW};
+        memory::dims strides = {s.stride, s.stride};
+        memory::dims padding = {s.pad, s.pad};
 
         // create memory for user data
-        const tensor_t bias(C);
+        const tensor_t bias(s.Co);
         auto user_input_memory = memory({{src_tz}, dt::f32, tag::nchw}, eng);
-        auto user_weights_memory = memory({{weights_tz}, dt::f32, tag::oihw}, eng);
         auto user_bias_memory = memory({{bias_tz}, dt::f32, tag::x}, eng);
         write_to_dnnl_memory(image.data(), user_input_memory);
-        write_to_dnnl_memory(weights.data(), user_weights_memory);
         write_to_dnnl_memory(bias.data(), user_bias_memory);
 
         // create memory descriptors for convolution data w/ no specified format
@@ -70,57 +110,120 @@ struct runner {
                     {{DNNL_ARG_FROM, user_input_memory},
                      {DNNL_ARG_TO, src_memory}});
         }
+        st.wait();
+
+        return ConvEntry {prim_desc, convolution_forward(prim_desc), src_memory,
+                user_bias_memory, memory(prim_desc.dst_desc(), eng)};
+    }
 
-        auto weights_memory = user_weights_memory;
-        if (prim_desc.weights_desc() != user_weights_memory.get_desc()) {
+    // blocked weights come zero-copy from wcache when it has them
+    memory make_weights(int N, const ConvShape &s,
+            const convolution_forward::primitive_desc &prim_desc,
+            const tensor_t &weights, std::uint64_t srchash) {
+        memory::dims weights_tz = {s.Co, s.Ci, s.Kh, s.Kw};
+        auto user_weights_memory = memory({{weights_tz}, dt::f32, tag::oihw}, eng);
+        write_to_dnnl_memory(weights.data(), user_weights_memory);
+        if (prim_desc.weights_desc() == user_weights_memory.get_desc())
+            return user_weights_memory;
+
+        auto t1 = steady_clock::now();
+        std::string key;
+        std::size_t size = 0;
+        void *blob = nullptr;
+        auto wsize = prim_desc.weights_desc().get_size();
+        if (wcache) {
+            key = cache_key(N, s, prim_desc);
+            blob = wcache->load(key, srchash, size);
+            if (size != wsize) blob = nullptr;
+        }
+        memory weights_memory;
+        if (blob) {
+            weights_memory = memory(prim_desc.weights_desc(), eng, blob);
+        } else {
             weights_memory = memory(prim_desc.weights_desc(), eng);
             reorder(user_weights_memory, weights_memory).execute(st,
                     {{DNNL_ARG_FROM, user_weights_memory},
                      {DNNL_ARG_TO, weights_memory}});
+            st.wait();
+            if (wcache)
+                wcache->store(key, srchash,
+                        weights_memory.get_data_handle(), wsize);
         }
+        if (wcache)
+            std::cout << "wcache," << key << ',' << (blob ? "hit" : "miss")
+                      << ',' << time_diff(steady_clock::now(), t1) * 1000
+                      << std::endl;
+        return weights_memory;
+    }
 
-        st.wait();
-        auto dst_memory = memory(prim_desc.dst_desc(), eng);
-
-        // create convolution primitive and add it to net
-        prims.push_back({
-            convolution_forward(prim_desc),
-            {{DNNL_ARG_SRC, src_memory},
-             {DNNL_ARG_WEIGHTS, weights_memory},
-             {DNNL_ARG_BIAS, user_bias_memory},
-             {DNNL_ARG_DST, dst_memory}}
-        });
+    void test_conv(int N, const ConvShape &s,
+            const tensor_t &weights, const tensor_t &image) {
+        auto key = shape_key(N, s);
+        auto it = convs.find(key);
+        if (it == convs.end())
+            it = convs.emplace(key, make_conv(N, s, image)).first;
+        auto &conv = it->second;
+
+        auto srchash = hash_bytes(weights.data(), weights.size() * sizeof(float));
+        auto wkey = key + '-' + std::to_string(srchash);
+        auto wit = wmems.find(wkey);
+        if (wit == wmems.end())
+            wit = wmems.emplace(wkey,
+                    make_weights(N, s, conv.pd, weights, srchash)).first;
+
+        layers.push_back({s, conv.prim,
+            {{DNNL_ARG_SRC, conv.src},
+             {DNNL_ARG_WEIGHTS, wit->second},
+             {DNNL_ARG_BIAS, conv.bias},
+             {DNNL_ARG_DST, conv.dst}},
+            std::string("dnnl_") + conv.pd.impl_info_str()});
     }
 
-    void exec(int times) {
+    // `warmup` untimed passes over the net, then `times` passes timing each
+    // primitive on its own, one line per layer and pass in the testbed's
+    // conv,fmt,alg,impl,spfmt,sparsity,F,H,C,K,S,convert,compute format
+    void exec(int times, int warmup = 1) {
+        for (int i = 0; i < warmup; i++)
+            for (auto &l: layers) l.prim.execute(st, l.args);
+        st.wait();
+        std::cout << "primcache," << layers.size() << ',' << convs.size()
+                  << ',' << wmems.size() << std::endl;
         for (int i = 0; i < times; i++) {
-            for (auto &it: prims) {
-                it.first.execute(st, it.second);
+            for (auto &l: layers) {
+                auto t1 = steady_clock::now();
+                l.prim.execute(st, l.args);
+                st.wait();
+                auto t2 = steady_clock::now();
+                auto &s = l.shape;
+                std::cout << "conv,nChw16c,direct," << l.impl << ",none,0,"
+                          << s.Co << ',' << s.HW << ',' << s.Ci << ','
+                          << s.Kh << ',' << s.stride << ",0,"
+                          << time_diff(t2, t1) * 1000 << std::endl;
             }
         }
-        st.wait();
     }
 };
 
 
-int main() {
-    std::ifstream infmt("../fmt.txt");
-    std::ifstream weightfile("../dat.bin", std::ios::binary);
-    int cnt_data_sets;
-    infmt >> cnt_data_sets;
+int main(int argc, char **argv) {
+    BaselineCompare baseline;
+    std::ifstream infmt(argc > 1 ? argv[1] : "../fmt.txt");
+    std::ifstream weightfile(argc > 2 ? argv[2] : "../dat.bin", std::ios::binary);
+    auto shapes = read_shapes(infmt);
     int nbatch = 10;
-    tensor_t indata(nbatch * 64 * 256 * 256);
+    std::size_t maxin = 0;
+    for (auto &s: shapes) maxin = std::max(maxin, s.insize());
+    tensor_t indata(nbatch * maxin);
     init_rand(indata);
-    runner robj;
-    for (int i = 0; i < cnt_data_sets; i++) {
-        int Co, Ci, Kh, Kw, total, HW;
-        infmt >> Co >> Ci >> Kh >> Kw;
-        HW = 64 * 256 / Co;
-        total = Co * Ci * Kh * Kw;
-        tensor_t weight(total);
+    std::unique_ptr<WeightCache> wcache;
+    auto wcdir = env_or("CB_WCACHE", "");
+    if (!wcdir.empty()) wcache.reset(new WeightCache(wcdir));
+    runner robj(wcache.get());
+    for (auto &s: shapes) {
+        tensor_t weight(s.Co * s.Ci * s.Kh * s.Kw);
         read_binary(weightfile, weight);
-        robj.test_conv(nbatch, Co, HW, weight, indata);
+        robj.test_conv(nbatch, s, weight, indata);
     }
     robj.exec(10);
-    return 0;
+    return baseline.finish();
 }
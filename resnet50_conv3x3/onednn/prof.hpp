@@ -0,0 +1,300 @@
+#ifndef _PROF_HPP_
+#define _PROF_HPP_
+#include "tensorutils.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cxxabi.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// In-process IP sampling, switched on with CB_PROF=<dir>.  Around each
+// profiled region every thread of the process gets its own perf event
+// (user-space cycles, or the cpu-clock software event where there is no
+// PMU) sampling at CB_PROF_FREQ Hz into an mmap'ed ring.  Samples add up
+// per label, and dump() writes <dir>/<label>.json in the basic-block schema
+// index.html renders.
+//
+// Since the events cover the whole process, regions must not overlap: a
+// begin() while another region is open turns profiling off with a message
+// and drops the open region's samples.  Callers that know their runs
+// overlap (CB_NUMA=2, CB_STREAMS) call disable() up front.
+//
+// Nothing here decodes instructions, so blocks are hot code ranges: the
+// sampled IPs of every function holding at least 1% of a label's samples,
+// split wherever two consecutive sampled IPs are more than 64 bytes apart.
+// Each block lists its sampled offsets within the function, which line up
+// with objdump -d of the binary or library.  Functions of the binary itself
+// are only named when it is linked with -rdynamic.
+namespace prof {
+
+inline std::string demangle(const char *name) {
+    int status = 0;
+    char *buf = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+    std::string ret = status == 0 ? buf : name;
+    std::free(buf);
+    return ret;
+}
+
+class Profiler {
+public:
+    struct Ring {
+        int fd;
+        void *base;
+    };
+    // the rings of one region, from begin() to end()
+    typedef std::vector<Ring> Session;
+
+private:
+    std::string dir;
+    int freq;
+    std::size_t pages;
+    std::atomic<bool> failed;
+    // guards the members below
+    std::mutex mtx;
+    bool busy;
+    std::map<std::string, std::map<std::uint64_t, std::uint64_t>> hists;
+    std::uint64_t lost;
+
+    int open_event(int tid, bool hw) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = hw ? PERF_TYPE_HARDWARE : PERF_TYPE_SOFTWARE;
+        attr.config = hw ? (std::uint64_t) PERF_COUNT_HW_CPU_CYCLES
+                         : (std::uint64_t) PERF_COUNT_SW_CPU_CLOCK;
+        attr.freq = 1;
+        attr.sample_freq = freq;
+        attr.sample_type = PERF_SAMPLE_IP;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0);
+    }
+
+    std::size_t ring_bytes() const {
+        return (pages + 1) * sysconf(_SC_PAGESIZE);
+    }
+
+    // copies the samples out of one ring, records may wrap around its end
+    void drain(const Ring &r, std::map<std::uint64_t, std::uint64_t> &hist,
+               std::uint64_t &nlost) {
+        auto meta = (perf_event_mmap_page*) r.base;
+        auto data = (const char*) r.base + sysconf(_SC_PAGESIZE);
+        std::uint64_t size = pages * sysconf(_SC_PAGESIZE);
+        std::uint64_t head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+        std::uint64_t tail = meta->data_tail;
+        auto copy = [&] (std::uint64_t pos, void *dst, std::size_t n) {
+            for (std::size_t i = 0; i < n; i++)
+                ((char*) dst)[i] = data[(pos + i) % size];
+        };
+        while (tail + sizeof(perf_event_header) <= head) {
+            perf_event_header hdr;
+            copy(tail, &hdr, sizeof(hdr));
+            if (hdr.size == 0) break;
+            std::uint64_t body[2];
+            if (hdr.type == PERF_RECORD_SAMPLE) {
+                copy(tail + sizeof(hdr), body, 8);
+                hist[body[0]]++;
+            } else if (hdr.type == PERF_RECORD_LOST) {
+                copy(tail + sizeof(hdr), body, 16);
+                nlost += body[1];
+            }
+            tail += hdr.size;
+        }
+        __atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+    }
+
+public:
+    Profiler()
+        : dir(env_or("CB_PROF", "")), freq(env_or("CB_PROF_FREQ", 4000)),
+          pages(env_or("CB_PROF_PAGES", 64)), failed(false), busy(false),
+          lost(0) {}
+
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    ~Profiler() { dump(); }
+
+    bool enabled() const { return !dir.empty() && !failed; }
+
+    // turns profiling off for the rest of the process, telling why
+    void disable(const char *why) {
+        if (failed.exchange(true) || dir.empty()) return;
+        std::cerr << "prof: " << why << ", profiling disabled" << std::endl;
+    }
+
+    // opens and enables one event per thread currently in the process
+    Session begin() {
+        Session rings;
+        if (!enabled()) return rings;
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            if (busy) {
+                disable("overlapping runs");
+                return rings;
+            }
+            busy = true;
+        }
+        DIR *tasks = opendir("/proc/self/task");
+        while (auto ent = tasks ? readdir(tasks) : nullptr) {
+            int tid = std::atoi(ent->d_name);
+            if (tid <= 0) continue;
+            int fd = open_event(tid, true);
+            if (fd < 0) fd = open_event(tid, false);
+            if (fd < 0) continue;
+            void *base = mmap(nullptr, ring_bytes(), PROT_READ | PROT_WRITE,
+                              MAP_SHARED, fd, 0);
+            if (base == MAP_FAILED) {
+                close(fd);
+                continue;
+            }
+            rings.push_back({fd, base});
+        }
+        if (tasks) closedir(tasks);
+        if (rings.empty()) {
+            disable("perf_event_open failed");
+            std::lock_guard<std::mutex> lk(mtx);
+            busy = false;
+        }
+        for (auto &r: rings) ioctl(r.fd, PERF_EVENT_IOC_ENABLE, 0);
+        return rings;
+    }
+
+    // closes a region, its samples going to label unless profiling was
+    // turned off meanwhile
+    void end(Session &rings, const std::string &label) {
+        if (rings.empty()) return;
+        std::map<std::uint64_t, std::uint64_t> hist;
+        std::uint64_t nlost = 0;
+        for (auto &r: rings) ioctl(r.fd, PERF_EVENT_IOC_DISABLE, 0);
+        for (auto &r: rings) {
+            drain(r, hist, nlost);
+            munmap(r.base, ring_bytes());
+            close(r.fd);
+        }
+        rings.clear();
+        std::lock_guard<std::mutex> lk(mtx);
+        busy = false;
+        if (!enabled()) return;
+        auto &dst = hists[label];
+        for (auto &h: hist) dst[h.first] += h.second;
+        lost += nlost;
+    }
+
+    void dump() {
+        if (dir.empty()) return;
+        std::lock_guard<std::mutex> lk(mtx);
+        mkdir(dir.c_str(), 0755);
+        for (auto &h: hists) dump_label(h.first, h.second);
+        if (lost)
+            std::cerr << "prof: " << lost << " samples lost, raise CB_PROF_PAGES"
+                      << std::endl;
+        hists.clear();
+    }
+
+private:
+    struct Func {
+        std::string name;
+        std::uint64_t start, samples;
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> ips;
+    };
+
+    static std::string hex(std::uint64_t v) {
+        std::ostringstream os;
+        os << std::hex << v;
+        return os.str();
+    }
+
+    static std::string json_str(const std::string &s) {
+        std::string ret = "\"";
+        for (char ch: s) {
+            if (ch == '"' || ch == '\\') ret += '\\';
+            if ((unsigned char) ch >= 0x20) ret += ch;
+        }
+        return ret + '"';
+    }
+
+    void dump_label(const std::string &label,
+                    const std::map<std::uint64_t, std::uint64_t> &hist) {
+        std::uint64_t total = 0;
+        std::map<std::uint64_t, Func> funcs;
+        for (auto &h: hist) {
+            total += h.second;
+            Dl_info info;
+            std::string name;
+            std::uint64_t start = 0;
+            bool found = dladdr((void*) h.first, &info);
+            if (found && info.dli_sname) {
+                name = demangle(info.dli_sname);
+                start = (std::uint64_t) info.dli_saddr;
+            } else if (found && info.dli_fname) {
+                name = info.dli_fname;
+                start = (std::uint64_t) info.dli_fbase;
+            } else {
+                name = "[unknown]";
+            }
+            auto &f = funcs[start];
+            f.name = name;
+            f.start = start;
+            f.samples += h.second;
+            f.ips.push_back(h);
+        }
+
+        std::string fn = label;
+        for (auto &ch: fn)
+            if (!isalnum(ch) && ch != '-' && ch != '.') ch = '_';
+        std::ofstream os(dir + '/' + fn + ".json");
+        os << std::setprecision(4) << '[';
+        const char *sep = "";
+        for (auto &it: funcs) {
+            auto &f = it.second;
+            if (f.samples * 100 < total) continue;
+            auto &ips = f.ips;
+            for (std::size_t b = 0, e; b < ips.size(); b = e) {
+                std::uint64_t cnt = ips[b].second;
+                for (e = b + 1; e < ips.size() && ips[e].first - ips[e - 1].first <= 64; e++)
+                    cnt += ips[e].second;
+                os << sep << "{\"loc\":\"" << hex(ips[b].first)
+                   << "\",\"percent\":" << 100.0 * cnt / total << ",\"insts\":[";
+                os << "{\"op\":" << json_str(f.name) << ",\"args\":\"+0x"
+                   << hex(ips[b].first - f.start) << "\",\"dst\":\"\"}";
+                for (auto i = b; i < e; i++)
+                    os << ",{\"op\":\"+0x" << hex(ips[i].first - f.start)
+                       << "\",\"args\":\"" << 100.0 * ips[i].second / total
+                       << "%\",\"dst\":\"\"}";
+                os << "],\"next_\":\""
+                   << (e < ips.size() ? hex(ips[e].first) : "")
+                   << "\",\"jump\":\"\"}";
+                sep = ",\n";
+            }
+        }
+        os << "]\n";
+    }
+};
+
+inline Profiler &profiler() {
+    static Profiler ret;
+    return ret;
+}
+
+}  // end namespace
+
+#endif  // _PROF_HPP_
@@ -0,0 +1,169 @@
+#ifndef _REGISTRY_HPP_
+#define _REGISTRY_HPP_
+#include "testbed.hpp"
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+typedef std::unique_ptr<NCHWDirectConv> ConvPtr;
+
+// A forward conv implementation: whether it handles a layer at a given
+// weight sparsity, and how to build it from a CaseProvider.
+struct ConvAlgo {
+    std::string name;
+    std::function<bool(const ConvShape&, int, float)> supports;
+    std::function<ConvPtr(CaseProvider&, float)> create;
+};
+
+template <typename ConvClass>
+ConvAlgo dense_algo(const char *name,
+        std::function<bool(const ConvShape&, int)> supports) {
+    return ConvAlgo {name,
+        [=] (const ConvShape &s, int N, float sp) {
+            return sp < 1 && supports(s, N);
+        },
+        [] (CaseProvider &cp, float sp) -> ConvPtr {
+            return cp.newConv<ConvClass>(sp);
+        }};
+}
+
+inline std::size_t conv_macs(const ConvShape &s, int N) {
+    std::size_t OHW = s.outsize();
+    return std::size_t(N) * s.Co * s.Ci * s.Kh * s.Kw * OHW * OHW;
+}
+
+// Every forward implementation the selector may pick from, in the order
+// they are trialed.  At sparsity sp > 0 the dense ones compute with the
+// weights pruned to what the CSR one keeps, so the trials weigh dense
+// GEMM against sparse at the same result; at 0 all of them take the
+// weights as given, CSR storing their nonzeros.
+inline const std::vector<ConvAlgo> &conv_algos() {
+    static std::vector<ConvAlgo> ret = {
+        // the naive loop only has a chance on tiny layers, and trialing it
+        // on anything bigger would take longer than the benchmark itself
+        dense_algo<NCHWDirectConv>("NCHWDirectConv",
+            [] (const ConvShape &s, int N) { return conv_macs(s, N) <= (1 << 24); }),
+        dense_algo<NCHWMklGemmConv>("NCHWMklGemmConv",
+            [] (const ConvShape&, int) { return true; }),
+        dense_algo<NHWCMklGemmConv>("NHWCMklGemmConv",
+            [] (const ConvShape&, int) { return true; }),
+        dense_algo<NCHWMklPackGemmConv>("NCHWMklPackGemmConv",
+            [] (const ConvShape&, int) { return true; }),
+        dense_algo<NHWCMklPackGemmConv>("NHWCMklPackGemmConv",
+            [] (const ConvShape&, int) { return true; }),
+        // needs enough images to fill at least half the lanes
+        dense_algo<NHWCnDirectConv>("NHWCnDirectConv",
+            [] (const ConvShape&, int N) { return 2 * N >= VecF::width; }),
+        dense_algo<NCHWMklTileConv>("NCHWMklTileConv",
+            [] (const ConvShape&, int) { return true; }),
+        dense_algo<NCHWMklSplitKConv>("NCHWMklSplitKConv",
+            [] (const ConvShape&, int) { return true; }),
+        // pointwise layers have no im2col to overlap
+        dense_algo<NCHWMklPipeGemmConv>("NCHWMklPipeGemmConv",
+            [] (const ConvShape &s, int) { return s.Kh != 1 || s.pad != 0; }),
+        ConvAlgo {"NCHWMklSpGemmConv",
+            [] (const ConvShape&, int, float sp) { return sp >= 0 && sp < 1; },
+            [] (CaseProvider &cp, float sp) -> ConvPtr {
+                auto conv = cp.newConv<NCHWMklSpGemmConv>();
+                conv->sparsity(sp);
+                return conv;
+            }},
+    };
+    return ret;
+}
+
+inline const ConvAlgo *find_algo(const std::string &name) {
+    for (auto &algo: conv_algos())
+        if (algo.name == name) return &algo;
+    return nullptr;
+}
+
+
+// Picks the fastest supporting algorithm per (shape, sparsity, threads, host
+// ISA, kernel variant) by timing each candidate for CB_SELECT_TRIALS passes
+// after one warmup, and keeps the decisions in a text file of "key name"
+// lines, so later runs dispatch without trials.  Decisions naming an
+// algorithm that no longer exists or supports the layer are trialed again.
+class AlgoSelector {
+    std::string path;
+    std::map<std::string, std::string> decisions;
+
+    void save() {
+        auto tmpfn = path + ".tmp";
+        {
+            std::ofstream os(tmpfn);
+            for (auto &d: decisions) os << d.first << ' ' << d.second << '\n';
+            if (!os) return;
+        }
+        std::rename(tmpfn.c_str(), path.c_str());
+    }
+
+public:
+    AlgoSelector(const std::string &path): path(path) {
+        std::ifstream is(path);
+        std::string key, name;
+        while (is >> key >> name) decisions[key] = name;
+    }
+
+    static std::string key(int N, const ConvShape &s, float sparsity) {
+        std::ostringstream os;
+        os << 'N' << N << 'C' << s.Ci << 'H' << s.HW << 'F' << s.Co
+           << 'K' << s.Kh << 'S' << s.stride << 'P' << s.pad
+           << "-sp" << sparsity << "-t" << numa::max_threads()
+           << '-' << isa_tag() << '-' << simd::variant();
+        return os.str();
+    }
+
+    const ConvAlgo &select(int N, const ConvShape &s, float sparsity,
+                           CaseProvider &cp) {
+        auto k = key(N, s, sparsity);
+        auto it = decisions.find(k);
+        if (it != decisions.end()) {
+            auto algo = find_algo(it->second);
+            if (algo && algo->supports(s, N, sparsity)) {
+                std::cout << "select," << k << ',' << algo->name << ",hit"
+                          << std::endl;
+                return *algo;
+            }
+        }
+        int trials = std::max(1, env_or("CB_SELECT_TRIALS", 3));
+        const ConvAlgo *best = nullptr;
+        double besttime = 0;
+        for (auto &algo: conv_algos()) {
+            if (!algo.supports(s, N, sparsity)) continue;
+            auto conv = algo.create(cp, sparsity);
+            conv->run();
+            double t = 0;
+            for (auto r: Range<>(0, trials)) {
+                auto times = conv->run();
+                double cur = times.first + times.second;
+                t = r ? std::min(t, cur) : cur;
+            }
+            std::cout << "trial," << k << ',' << algo.name << ',' << t
+                      << std::endl;
+            if (!best || t < besttime) {
+                best = &algo;
+                besttime = t;
+            }
+        }
+        assert (best);
+        std::cout << "select," << k << ',' << best->name << ",trial"
+                  << std::endl;
+        decisions[k] = best->name;
+        save();
+        return *best;
+    }
+
+    ConvPtr create(int N, const ConvShape &s, float sparsity, CaseProvider &cp) {
+        return select(N, s, sparsity, cp).create(cp, sparsity);
+    }
+};
+
+#endif  // _REGISTRY_HPP_
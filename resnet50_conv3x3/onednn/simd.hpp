@@ -0,0 +1,204 @@
+#ifndef _SIMD_HPP_
+#define _SIMD_HPP_
+#include <cstdint>
+#include <cstring>
+#include <immintrin.h>
+
+// One register of floats for the widest ISA the build targets (-xHost,
+// -march=...): AVX-512, AVX2, or a single scalar lane otherwise, named by
+// variant().  A Mask selects the first n lanes; full-width masks take the
+// plain load/store path, which folds away once VecRange has inlined the
+// body.  load_half and load_bf16 widen IEEE half and bfloat16 words.
+namespace simd {
+
+inline float half_to_float(std::uint16_t h) {
+    std::uint32_t sign = std::uint32_t(h & 0x8000) << 16, x;
+    std::uint32_t e = (h >> 10) & 0x1f, m = h & 0x3ff;
+    float ret;
+    if (e == 0) {
+        // subnormal, m * 2^-24 is exact
+        ret = m / 16777216.0f;
+        std::memcpy(&x, &ret, 4);
+        x |= sign;
+    } else if (e == 31) {
+        x = sign | 0x7f800000 | (m << 13);
+    } else {
+        x = sign | ((e + 112) << 23) | (m << 13);
+    }
+    std::memcpy(&ret, &x, 4);
+    return ret;
+}
+
+inline float bf16_to_float(std::uint16_t h) {
+    std::uint32_t x = std::uint32_t(h) << 16;
+    float ret;
+    std::memcpy(&ret, &x, 4);
+    return ret;
+}
+
+#if defined(__AVX512F__)
+
+inline const char *variant() { return "avx512"; }
+
+struct Mask {
+    int n;
+    __mmask16 k;
+    static Mask first(int n) { return Mask {n, __mmask16((1u << n) - 1)}; }
+};
+
+struct VecF {
+    enum { width = 16 };
+    __m512 r;
+
+    static VecF zero() { return VecF {_mm512_setzero_ps()}; }
+    static VecF broadcast(float v) { return VecF {_mm512_set1_ps(v)}; }
+
+    static VecF load(const float *p, Mask m) {
+        return VecF {m.n == width ? _mm512_loadu_ps(p)
+                                  : _mm512_maskz_loadu_ps(m.k, p)};
+    }
+
+    void store(float *p, Mask m) const {
+        if (m.n == width) _mm512_storeu_ps(p, r);
+        else _mm512_mask_storeu_ps(p, m.k, r);
+    }
+
+    // 16-bit words, tails through a zeroed copy
+    static __m256i load_u16(const std::uint16_t *p, Mask m) {
+        if (m.n == width) return _mm256_loadu_si256((const __m256i*) p);
+        alignas(32) std::uint16_t tmp[width] = {};
+        std::memcpy(tmp, p, m.n * sizeof(*p));
+        return _mm256_load_si256((const __m256i*) tmp);
+    }
+
+    static VecF load_half(const std::uint16_t *p, Mask m) {
+        return VecF {_mm512_cvtph_ps(load_u16(p, m))};
+    }
+
+    static VecF load_bf16(const std::uint16_t *p, Mask m) {
+        return VecF {_mm512_castsi512_ps(
+                _mm512_slli_epi32(_mm512_cvtepu16_epi32(load_u16(p, m)), 16))};
+    }
+};
+
+inline VecF fmadd(VecF a, VecF b, VecF c) { return VecF {_mm512_fmadd_ps(a.r, b.r, c.r)}; }
+inline VecF operator+(VecF a, VecF b) { return VecF {_mm512_add_ps(a.r, b.r)}; }
+
+#elif defined(__AVX2__)
+
+inline const char *variant() { return "avx2"; }
+
+struct Mask {
+    int n;
+    __m256i v;
+    static Mask first(int n) {
+        return Mask {n, _mm256_cmpgt_epi32(_mm256_set1_epi32(n),
+                                           _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))};
+    }
+};
+
+struct VecF {
+    enum { width = 8 };
+    __m256 r;
+
+    static VecF zero() { return VecF {_mm256_setzero_ps()}; }
+    static VecF broadcast(float v) { return VecF {_mm256_set1_ps(v)}; }
+
+    static VecF load(const float *p, Mask m) {
+        return VecF {m.n == width ? _mm256_loadu_ps(p) : _mm256_maskload_ps(p, m.v)};
+    }
+
+    void store(float *p, Mask m) const {
+        if (m.n == width) _mm256_storeu_ps(p, r);
+        else _mm256_maskstore_ps(p, m.v, r);
+    }
+
+    static __m128i load_u16(const std::uint16_t *p, Mask m) {
+        if (m.n == width) return _mm_loadu_si128((const __m128i*) p);
+        alignas(16) std::uint16_t tmp[width] = {};
+        std::memcpy(tmp, p, m.n * sizeof(*p));
+        return _mm_load_si128((const __m128i*) tmp);
+    }
+
+#ifdef __F16C__
+    static VecF load_half(const std::uint16_t *p, Mask m) {
+        return VecF {_mm256_cvtph_ps(load_u16(p, m))};
+    }
+#else
+    static VecF load_half(const std::uint16_t *p, Mask m) {
+        alignas(32) float tmp[width] = {};
+        for (int i = 0; i < m.n; i++) tmp[i] = half_to_float(p[i]);
+        return VecF {_mm256_load_ps(tmp)};
+    }
+#endif
+
+    static VecF load_bf16(const std::uint16_t *p, Mask m) {
+        return VecF {_mm256_castsi256_ps(
+                _mm256_slli_epi32(_mm256_cvtepu16_epi32(load_u16(p, m)), 16))};
+    }
+};
+
+#ifdef __FMA__
+inline VecF fmadd(VecF a, VecF b, VecF c) { return VecF {_mm256_fmadd_ps(a.r, b.r, c.r)}; }
+#else
+inline VecF fmadd(VecF a, VecF b, VecF c) {
+    return VecF {_mm256_add_ps(_mm256_mul_ps(a.r, b.r), c.r)};
+}
+#endif
+inline VecF operator+(VecF a, VecF b) { return VecF {_mm256_add_ps(a.r, b.r)}; }
+
+#else
+
+inline const char *variant() { return "generic"; }
+
+struct Mask {
+    int n;
+    static Mask first(int n) { return Mask {n}; }
+};
+
+struct VecF {
+    enum { width = 1 };
+    float r;
+
+    static VecF zero() { return VecF {0}; }
+    static VecF broadcast(float v) { return VecF {v}; }
+    static VecF load(const float *p, Mask) { return VecF {*p}; }
+    void store(float *p, Mask) const { *p = r; }
+    static VecF load_half(const std::uint16_t *p, Mask) { return VecF {half_to_float(*p)}; }
+    static VecF load_bf16(const std::uint16_t *p, Mask) { return VecF {bf16_to_float(*p)}; }
+};
+
+inline VecF fmadd(VecF a, VecF b, VecF c) { return VecF {a.r * b.r + c.r}; }
+inline VecF operator+(VecF a, VecF b) { return VecF {a.r + b.r}; }
+
+#endif
+
+
+// [start, stop) in register-sized chunks: func(idx, mask) covers lanes
+// idx .. idx + VecF::width, with unrollLen full chunks per iteration of
+// the main loop, and one last call masked down to the remainder.
+template <typename dtype, int unrollLen = 1>
+struct VecRange {
+    const dtype start, stop;
+
+    VecRange(dtype start, dtype stop)
+        : start(start), stop(stop) { }
+
+    template <typename Func>
+    void foreach(Func func) const {
+        const int width = VecF::width;
+        const Mask full = Mask::first(width);
+        dtype idx = start;
+        if (unrollLen > 1)
+            for (; idx + unrollLen * width <= stop; idx += unrollLen * width)
+                for (int u = 0; u < unrollLen; u++)
+                    func(idx + u * width, full);
+        for (; idx + width <= stop; idx += width)
+            func(idx, full);
+        if (idx < stop)
+            func(idx, Mask::first(stop - idx));
+    }
+};
+
+}  // end namespace
+#endif  // _SIMD_HPP_
@@ -0,0 +1,105 @@
+#ifndef _STREAMS_HPP_
+#define _STREAMS_HPP_
+#include "registry.hpp"
+#include "numa.hpp"
+#include "prof.hpp"
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+// K independent inference streams sharing the host: stream k owns a
+// PinnedTeam of tps threads on cpus [k * tps, (k + 1) * tps) of the main
+// team's order, and its own convs of the whole layer sequence, built on
+// that team so their buffers are local.  All streams then run `passes`
+// requests (one pass over every layer) at once.  Prints one line per
+// stream and one for the configuration,
+//   stream,K,tps,k,p50_ms,p99_ms
+//   streams,algo,batch,K,tps,passes,img_per_s,p50_ms,p99_ms,worst_p99_ms
+// with the percentiles of per-request latency.
+inline void stream_bench(const std::vector<ConvShape> &shapes,
+                         const std::vector<tensor_t> &weights,
+                         const tensor_t &indata, const ConvAlgo &algo,
+                         int batch, int K, int tps, int passes) {
+    auto cpus = numa::compact_cpus();
+    std::vector<std::unique_ptr<numa::PinnedTeam>> teams;
+    std::vector<std::vector<ConvPtr>> convs(K);
+    std::vector<std::vector<double>> lat(K);
+    for (auto k: Range<int>(0, K)) {
+        std::vector<int> part(cpus.begin() + k * tps, cpus.begin() + (k + 1) * tps);
+        teams.emplace_back(new numa::PinnedTeam(part, tps));
+        teams[k]->submit([&, k] {
+            for (auto l: Range<>(0, shapes.size())) {
+                auto &s = shapes[l];
+                CaseProvider cp(indata, {batch, s.Ci, s.HW, s.HW}, weights[l],
+                                {s.Co, s.Ci, s.Kh, s.Kw}, s.stride, s.pad);
+                convs[k].push_back(algo.create(cp, 0));
+                convs[k].back()->run();
+            }
+        });
+    }
+    for (auto &t: teams) t->wait();
+
+    auto t0 = steady_clock::now();
+    for (auto k: Range<int>(0, K))
+        teams[k]->submit([&, k] {
+            for (int p = 0; p < passes; p++) {
+                auto t1 = steady_clock::now();
+                for (auto &conv: convs[k]) conv->run();
+                lat[k].push_back(time_diff(steady_clock::now(), t1) * 1000);
+            }
+        });
+    for (auto &t: teams) t->wait();
+    double wall = time_diff(steady_clock::now(), t0);
+
+    std::vector<double> all;
+    double worst = 0;
+    for (auto k: Range<int>(0, K)) {
+        double p99 = percentile(lat[k], 0.99);
+        worst = std::max(worst, p99);
+        all.insert(all.end(), lat[k].begin(), lat[k].end());
+        std::cout << "stream," << K << ',' << tps << ',' << k
+                  << ',' << percentile(lat[k], 0.5) << ',' << p99 << std::endl;
+    }
+    std::cout << "streams," << algo.name << ',' << batch << ',' << K
+              << ',' << tps << ',' << passes
+              << ',' << double(K) * passes * batch / wall
+              << ',' << percentile(all, 0.5) << ',' << percentile(all, 0.99)
+              << ',' << worst << std::endl;
+}
+
+// CB_STREAMS=<list> (or "auto" for powers of two) sweeps the stream count
+// against CB_STREAM_THREADS=<list> threads per stream (powers of two by
+// default), skipping pairs that need more cpus than the main team has.
+// Streams run CB_STREAM_ALGO (NCHWMklGemmConv) at batch CB_STREAM_BATCH
+// (1) for CB_STREAM_PASSES (20) requests each.
+inline void stream_sweep(const std::vector<ConvShape> &shapes,
+                         const std::vector<tensor_t> &weights,
+                         const tensor_t &indata, int maxbatch) {
+    int total = std::min<int>(numa::max_threads(), numa::compact_cpus().size());
+    auto pow2 = [] (int upto) {
+        std::vector<int> ret;
+        for (int v = 1; v <= upto; v *= 2) ret.push_back(v);
+        return ret;
+    };
+    auto kspec = env_or("CB_STREAMS", "auto"), tspec = env_or("CB_STREAM_THREADS", "");
+    auto ks = kspec == "auto" ? pow2(total) : numa::parse_cpulist(kspec);
+    auto algo = find_algo(env_or("CB_STREAM_ALGO", "NCHWMklGemmConv"));
+    int batch = std::min(maxbatch, env_or("CB_STREAM_BATCH", 1));
+    int passes = std::max(1, env_or("CB_STREAM_PASSES", 20));
+    if (!algo) {
+        std::cerr << "unknown CB_STREAM_ALGO" << std::endl;
+        return;
+    }
+    // the streams' runs overlap, see prof.hpp
+    prof::profiler().disable("CB_STREAMS runs streams at once");
+    for (int K: ks) {
+        auto ts = tspec.empty() ? pow2(total / std::max(1, K)) : numa::parse_cpulist(tspec);
+        for (int tps: ts)
+            if (K > 0 && tps > 0 && K * tps <= total)
+                stream_bench(shapes, weights, indata, *algo, batch, K, tps, passes);
+    }
+}
+
+#endif  // _STREAMS_HPP_
@@ -1,17 +1,64 @@
 #ifndef _TENSORUTILS_HPP_
 #define _TENSORUTILS_HPP_
+#include <cstdlib>
 #include <iostream>
+#include <sstream>
+#include <string>
 #include <vector>
 #include <random>
 #include <algorithm>
 #include <chrono>
+#include <cmath>
+#include "numa.hpp"
 using namespace std::chrono;
-typedef std::vector<float> tensor_t;
+typedef std::vector<float, FirstTouchAllocator<float>> tensor_t;
 
 template <typename contTy>
 void read_binary(std::istream &is, contTy &vec) {
     is.read((char*) vec.data(),
-            vec.size() * sizeof(contTy::value_type));
+            vec.size() * sizeof(typename contTy::value_type));
+}
+
+struct ConvShape {
+    int Co, Ci, Kh, Kw, stride, pad, HW;
+
+    int outsize() const { return (HW + 2 * pad - Kh) / stride + 1; }
+    std::size_t insize() const { return std::size_t(Ci) * HW * HW; }
+};
+
+// fmt.txt holds a layer count, then `Co Ci Kh Kw stride pad HW` per layer;
+// legacy `Co Ci Kh Kw` lines mean stride 1, same padding and HW = 64*256/Co.
+inline std::vector<ConvShape> read_shapes(std::istream &is) {
+    int cnt = 0; is >> cnt;
+    std::vector<ConvShape> ret(cnt);
+    std::string line;
+    for (auto &s: ret) {
+        do std::getline(is, line);
+        while (is && line.find_first_not_of(" \t\r") == std::string::npos);
+        std::istringstream ls(line);
+        ls >> s.Co >> s.Ci >> s.Kh >> s.Kw;
+        if (!(ls >> s.stride >> s.pad >> s.HW)) {
+            s.stride = 1;
+            s.pad = s.Kh / 2;
+            s.HW = 64 * 256 / s.Co;
+        }
+    }
+    return ret;
+}
+
+// optional benchmark modes are switched on through CB_* environment variables
+template <typename T>
+T env_or(const char *name, T dflt) {
+    const char *val = std::getenv(name);
+    if (!val || !*val) return dflt;
+    std::istringstream is(val);
+    is >> dflt;
+    return dflt;
+}
+
+inline std::string env_or(const char *name, const char *dflt) {
+    const char *val = std::getenv(name);
+    return (val && *val) ? val : dflt;
 }
 
 template <typename contTy>
@@ -22,11 +69,31 @@ void init_rand(contTy &vec) {
     // std::generate(vec.begin(), vec.end(), randgen);
 }
 
+// init_rand's values with runs of `block` elements zeroed at probability
+// sparsity, standing in for post-ReLU activations
+template <typename contTy>
+void init_sparse(contTy &vec, float sparsity, int block = 1) {
+    std::minstd_rand0 randgen(0);
+    std::uniform_real_distribution<float> coin(0, 1);
+    bool zero = false;
+    for (std::size_t i = 0; i < vec.size(); ++i) {
+        if (i % block == 0) zero = coin(randgen) < sparsity;
+        vec[i] = zero ? 0 : 1 + int(randgen() / 1e7);
+    }
+}
+
 template <typename TPoint, typename retTy = double>
 retTy time_diff(TPoint t2, TPoint t1) {
     return duration_cast<duration<retTy>>(t2 - t1).count();
 }
 
+// nearest-rank percentile, p in (0, 1]
+inline double percentile(std::vector<double> samples, double p) {
+    std::sort(samples.begin(), samples.end());
+    std::size_t k = std::ceil(p * samples.size());
+    return samples[std::max<std::size_t>(k, 1) - 1];
+}
+
 template <typename contTy>
 typename contTy::value_type square_diff(contTy &a, contTy &b) {
     typename contTy::value_type ret = 0, temp;
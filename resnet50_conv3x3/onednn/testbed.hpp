@@ -2,104 +2,345 @@
 #define _TESTBED_H_
 #include "dimidx.hpp"
 #include "tensorutils.hpp"
+#include "wcache.hpp"
+#include "numa.hpp"
+#include "memstat.hpp"
+#include "trace.hpp"
+#include "prof.hpp"
+#include "view.hpp"
 #include <memory>
+#include <sstream>
 #include <mkl.h>
 #include <mkl_spblas.h>
 using DI::Range;
 using DI::DimIdx;
+using simd::VecF;
 
 
 #define CONSTSTR(name,str) const char* name() { return str; }
 #define FOR1(idx, start, stop) for (int idx = start; idx < stop; idx++)
 
 
+template <typename ConvClass> class NumaSplitConv;
+
+
+// Input and weights of one layer.  The input is a view, which convs may
+// read in place (see NCHWDirectConv::load_input), so it has to outlive
+// them.
 class CaseProvider {
-    const tensor_t &data, &weight;
+    cview_t data;
+    const tensor_t &weight;
     DimIdx<4> dData, dWeight;
+    int stride, pad;
+    WeightCache *wcache;
 
 public:
+    CaseProvider(const cview_t &data,
+                 const tensor_t &weight, const DimIdx<4> &dWeight,
+                 int stride = 1, int pad = 1, WeightCache *wcache = nullptr)
+        : data(data), weight(weight),
+          dData(data.sizes[0], data.sizes[1], data.sizes[2], data.sizes[3]),
+          dWeight(dWeight), stride(stride), pad(pad), wcache(wcache)
+    {}
+
+    // the leading N x C x H x W of a dense NCHW buffer
     CaseProvider(const tensor_t &data,   const DimIdx<4> &dData,
-                 const tensor_t &weight, const DimIdx<4> &dWeight)
-        : data(data), weight(weight), dData(dData), dWeight(dWeight)
+                 const tensor_t &weight, const DimIdx<4> &dWeight,
+                 int stride = 1, int pad = 1, WeightCache *wcache = nullptr)
+        : CaseProvider(make_view(data.data(), dData.range, dData.sub.range,
+                                 dData.sub.sub.range, dData.sub.sub.sub.range),
+                       weight, dWeight, stride, pad, wcache)
     {}
 
+    // prune > 0 has a dense class compute with the weights pruned as
+    // NCHWMklSpGemmConv keeps them at that sparsity, see prune_rows
     template <typename ConvClass>
-    std::unique_ptr<ConvClass> newConv() {
+    std::unique_ptr<ConvClass> newConv(float prune = 0) {
         auto ret = new ConvClass;
-        ret->check_size(dData, dWeight);
-        ret->prepare_data(data, weight);
+        ret->check_size(dData, dWeight, stride, pad);
+        ret->set_cache(wcache);
+        ret->set_prune(prune);
+        {
+            TRACE_SCOPE("prepare_data");
+            ret->prepare_data(data, weight);
+        }
         return std::unique_ptr<ConvClass>(ret);
     }
+
+    // One instance per NUMA node over its slice of the batch, each built on
+    // the node's own team so its buffers and weight copy are node-local.
+    template <typename ConvClass>
+    std::unique_ptr<NumaSplitConv<ConvClass>> newSplitConv() {
+        std::unique_ptr<NumaSplitConv<ConvClass>> ret(new NumaSplitConv<ConvClass>);
+        auto &teams = numa::node_teams();
+        int N = data.sizes[0], nn = teams.size();
+        ret->convs.resize(nn);
+        FOR1 (i, 0, nn) {
+            int n0 = N * i / nn, n1 = N * (i + 1) / nn;
+            if (n0 == n1) continue;
+            teams[i]->submit([=, &ret] {
+                CaseProvider sub(data.batch(n0, n1), weight, dWeight,
+                                 stride, pad, wcache);
+                ret->convs[i] = sub.newConv<ConvClass>();
+            });
+        }
+        for (auto &t: teams) t->wait();
+        return ret;
+    }
 };
 
 
+// Per filter row of len weights: NCHWMklSpGemmConv keeps those above the
+// value at rank sp * len, the same cut for every class at sparsity sp.
+inline float row_threshold(const float *row, int len, float sp) {
+    std::vector<float> cur(row, row + len);
+    auto nth = cur.begin() + int(sp * len);
+    std::nth_element(cur.begin(), nth, cur.end());
+    return *nth;
+}
+
+// F x len weights with everything at or below the threshold zeroed
+inline tensor_t prune_rows(const tensor_t &w, int F, float sp) {
+    tensor_t ret(w.size());
+    int len = w.size() / F;
+    #pragma omp parallel for
+    for (int jf = 0; jf < F; jf++) {
+        auto flag = row_threshold(&w[std::size_t(jf) * len], len, sp);
+        for (std::size_t i = std::size_t(jf) * len; i < std::size_t(jf + 1) * len; i++)
+            ret[i] = w[i] > flag ? w[i] : 0;
+    }
+    return ret;
+}
+
+
+// The padded input is kept phase-decomposed: pixel (h, w) of the padded
+// image lives in plane (h % S, w % S) at (h / S, w / S), so tap (kh, kw) of
+// output (oh, ow) is read contiguously along ow at any stride.  With S == 1
+// this is the plain padded NCHW/NHWC layout.
 class NCHWDirectConv {
 protected:
-    int N, C, H, W, F, K;
+    int N, C, H, W, F, K, S, P;
+    int Hq, Wq, OH, OW;
     tensor_t data, weight, result;
+    // padded input as the kernels read it: this->data or, when the caller's
+    // tensor already is that layout, the caller's tensor
+    const float *dptr;
+    // packed weights as compute_kernel reads them: this->weight or a
+    // zero-copy mapping handed out by wcache
+    const float *wptr;
+    WeightCache *wcache;
+    // sparsity the weights were pruned to before packing, see set_prune
+    float prunerate;
 
     virtual CONSTSTR(fmt, "NCHW")
     virtual CONSTSTR(alg, "direct")
     virtual CONSTSTR(impl, "raw")
     virtual CONSTSTR(spfmt, "none")
-    virtual float sparsity() { return 0; }
+    virtual float sparsity() { return prunerate; }
+    // whether pack_weight does enough work to be worth persisting
+    virtual bool cacheable() { return false; }
+
+    // 1x1 without padding: the (0, 0) phase plane is already the
+    // subsampled input, so GEMM paths can skip im2col entirely
+    bool pointwise() const { return K == 1 && P == 0; }
+
+    virtual void pack_weight(const tensor_t &weight) {
+        this->weight = weight;
+    }
+
+    std::string cache_key() {
+        std::ostringstream os;
+        os << fmt() << '-' << alg() << '-' << impl()
+           << '-' << spfmt() << sparsity()
+           << "-N" << N << 'C' << C << 'H' << H << 'F' << F
+           << 'K' << K << 'S' << S << 'P' << P << 'W' << W
+           << '-' << isa_tag() << "-mkl" << INTEL_MKL_VERSION;
+        return os.str();
+    }
+
+    // Looks src's packed form up in wcache.  On a miss pack() fills the
+    // members and returns the bytes to persist, and nullptr is returned.
+    template <typename PackFn>
+    void *fetch_packed(const tensor_t &src, std::size_t &size, PackFn pack) {
+        if (!wcache) {
+            pack();
+            return nullptr;
+        }
+        auto t1 = steady_clock::now();
+        auto key = cache_key();
+        auto srchash = hash_bytes(src.data(), src.size() * sizeof(float));
+        auto blob = wcache->load(key, srchash, size);
+        if (!blob) {
+            auto packed = pack();
+            wcache->store(key, srchash, packed.first, packed.second);
+        }
+        auto t2 = steady_clock::now();
+        std::cout << "wcache," << key << ',' << (blob ? "hit" : "miss")
+                  << ',' << time_diff(t2, t1) * 1000 << std::endl;
+        return blob;
+    }
+
+    void prepare_weight(const tensor_t &weight) {
+        TRACE_SCOPE("prepare_weight");
+        tensor_t pruned;
+        if (prunerate > 0) pruned = prune_rows(weight, F, prunerate);
+        const tensor_t &src = prunerate > 0 ? pruned : weight;
+        std::size_t size = 0;
+        auto pack = [&] {
+            pack_weight(src);
+            return std::make_pair((const void*) this->weight.data(),
+                                  this->weight.size() * sizeof(float));
+        };
+        wptr = nullptr;
+        if (cacheable())
+            wptr = (const float*) fetch_packed(src, size, pack);
+        else
+            pack();
+        if (!wptr) wptr = this->weight.data();
+    }
 
     virtual void im2col() {}
 
     virtual void compute_kernel() {
-        auto aData = DimIdx<4>{N, C, H+2, W+2}.bind(data);
-        auto aWeight = DimIdx<4>{F, C, K, K}.bind(weight);
-        auto aRet = DimIdx<4>{N, F, H, W}.bind(result);
-        #pragma omp parallel for collapse(2)
-        FOR1 (in, 0, N)
-        FOR1 (jf, 0, F)
-        FOR1 (ih, 0, H)
-        FOR1 (iw, 0, W)
+        auto aData = DimIdx<6>{N, C, S, S, Hq, Wq}.bind(dptr);
+        auto aWeight = DimIdx<4>{F, C, K, K}.bind(wptr);
+        auto aRet = DimIdx<4>{N, F, OH, OW}.bind(result);
+        #pragma omp parallel
         {
-            tensor_t::value_type sum = 0;
-            FOR1 (ic, 0, C)
-            FOR1 (kh, 0, K)
-            FOR1 (kw, 0, K)
-            {
-                sum += aData(in, ic, ih+kh, iw+kw) * aWeight(jf, ic, kh, kw);
-            }
-            aRet(in, jf, ih, iw) = sum;
+            TRACE_SCOPE("direct");
+            // rows too, so that batch 1 still spreads over the team
+            #pragma omp for collapse(3) nowait
+            FOR1 (in, 0, N)
+            FOR1 (jf, 0, F)
+            FOR1 (oh, 0, OH)
+            Range<int>(0, OW).vectorize().foreach([&] (int ow, simd::Mask m) {
+                auto sum = VecF::zero();
+                FOR1 (ic, 0, C)
+                FOR1 (kh, 0, K)
+                FOR1 (kw, 0, K)
+                {
+                    sum = fmadd(VecF::broadcast(aWeight(jf, ic, kh, kw)),
+                            VecF::load(&aData(in, ic, kh % S, kw % S, oh + kh / S, ow + kw / S), m),
+                            sum);
+                }
+                sum.store(&aRet(in, jf, oh, ow), m);
+            });
         }
     }
 
 public:
+    NCHWDirectConv(): dptr(nullptr), wptr(nullptr), wcache(nullptr),
+                      prunerate(0) {}
     virtual ~NCHWDirectConv() {}
 
-    void check_size(const DimIdx<4> &dData, const DimIdx<4> &dWeight) {
+    void set_cache(WeightCache *c) { wcache = c; }
+    void set_prune(float sp) { prunerate = sp; }
+
+    void check_size(const DimIdx<4> &dData, const DimIdx<4> &dWeight,
+                    int stride, int pad) {
         dData.unpack(N, C, H, W);
         dWeight.unpack(F, DI::None, K, DI::None);
-        assert (dWeight.validate(DI::Any, C, 3, K));
-        result.resize(N * F * H * W);
+        assert (dWeight.validate(DI::Any, C, K, K));
+        assert (stride > 0 && pad >= 0);
+        S = stride; P = pad;
+        OH = (H + 2 * P - K) / S + 1;
+        OW = (W + 2 * P - K) / S + 1;
+        Hq = (H + 2 * P + S - 1) / S;
+        Wq = (W + 2 * P + S - 1) / S;
+        result.resize(N * F * OH * OW);
+    }
+
+    virtual void prepare_data(const cview_t &data, const tensor_t &weight) {
+        load_input(data);
+        prepare_weight(weight);
     }
 
-    virtual void prepare_data(const tensor_t &data, const tensor_t &weight) {
-        auto aOrig = DimIdx<4>{N, C, H, W}.bind(data);
-        auto aNew = DimIdx<4>{N, C, H+2, W+2}.bind<true>(this->data);
+    // Points dptr at the N x C x H x W input in the padded layout.  Without
+    // padding and at stride 1 that layout is plain NCHW, so a dense src is
+    // read in place until the next load_input; otherwise src is copied into
+    // data, whose padding keeps the zeros of its allocation.
+    virtual void load_input(const cview_t &src) {
+        if (P == 0 && S == 1 && src.dense(Layout::NCHW)) {
+            dptr = src.data;
+            return;
+        }
+        auto aNew = DimIdx<6>{N, C, S, S, Hq, Wq}.bind<true>(this->data);
         FOR1 (in, 0, N)
         FOR1 (ic, 0, C)
         FOR1 (ih, 0, H)
         FOR1 (iw, 0, W)
-            aNew(in, ic, ih+1, iw+1) = aOrig(in, ic, ih, iw);
-        
-        this->weight = weight;
+        {
+            int ph = ih + P, pw = iw + P;
+            aNew(in, ic, ph % S, pw % S, ph / S, pw / S) = src(in, ic, ih, iw);
+        }
+        dptr = this->data.data();
     }
 
-    void compute() {
+    // writes the N x F x OH x OW output into dst, any layout
+    virtual void store_result(const view_t &dst) {
+        auto aRet = DimIdx<4>{N, F, OH, OW}.bind(result);
+        FOR1 (in, 0, N)
+        FOR1 (jf, 0, F)
+        FOR1 (oh, 0, OH)
+        FOR1 (ow, 0, OW)
+            dst(in, jf, oh, ow) = aRet(in, jf, oh, ow);
+    }
+
+    // one pass, returning the convert and compute times in ms; with CB_PROF
+    // set it is sampled under the conv's cache key, see prof.hpp
+    std::pair<double, double> run() {
+        TRACE_SCOPE_D("run", trace::intern(cache_key()));
+        auto &prof = prof::profiler();
+        auto session = prof.begin();
         auto t1 = steady_clock::now();
-        im2col();
+        {
+            TRACE_SCOPE("im2col");
+            im2col();
+        }
         auto t2 = steady_clock::now();
-        compute_kernel();
+        {
+            TRACE_SCOPE("compute_kernel");
+            compute_kernel();
+        }
         auto t3 = steady_clock::now();
-        auto time_convert = time_diff(t2, t1) * 1000;
-        auto time_compute = time_diff(t3, t2) * 1000;
+        if (!session.empty()) prof.end(session, cache_key());
+        return {time_diff(t2, t1) * 1000, time_diff(t3, t2) * 1000};
+    }
+
+    void compute() {
+        report(run());
+    }
+
+    // convert + compute of repeated single passes as p50 and p99
+    // (nearest rank), for the batch-1 latency mode
+    void report_latency(const std::vector<double> &samples) {
+        std::cout << "latency," << fmt() << ',' << alg() << ',' << impl()
+                  << ',' << spfmt() << ',' << sparsity()
+                  << ',' << F << ',' << H
+                  << ',' << C << ',' << K << ',' << S
+                  << ',' << percentile(samples, 0.5)
+                  << ',' << percentile(samples, 0.99)
+                  << ',' << samples.size() << std::endl;
+    }
+
+    // footprint of one (layer, implementation) from creation to result,
+    // in MB and page faults, see memstat.hpp
+    void report_memory(const memstat::Usage &u) {
+        std::cout << "mem," << fmt() << ',' << alg() << ',' << impl()
+                  << ',' << spfmt() << ',' << sparsity()
+                  << ',' << F << ',' << H
+                  << ',' << C << ',' << K << ',' << S
+                  << ',' << u.allocated / 1048576.0 << ',' << u.peak / 1048576.0
+                  << ',' << u.minflt << ',' << u.majflt << std::endl;
+    }
+
+    void report(std::pair<double, double> times) {
+        auto time_convert = times.first;
+        auto time_compute = times.second;
         std::cout << "conv," << fmt() << ',' << alg() << ',' << impl()
                   << ',' << spfmt() << ',' << sparsity()
                   << ',' << F << ',' << H
+                  << ',' << C << ',' << K << ',' << S
                   << ',' << time_convert << ',' << time_compute
                   << std::endl;
     }
@@ -107,6 +348,10 @@ public:
     virtual tensor_t get_result() {
         return result;
     }
+
+    // whether get_result() converts from another layout instead of
+    // copying result out
+    virtual bool converts_result() { return false; }
 };
 
 
@@ -118,26 +363,308 @@ protected:
     CONSTSTR(impl, "mkl")
 
     void im2col() {
-        auto aData = DimIdx<4>{N, C, H+2, W+2}.bind(data);
-        auto aScratch = DimIdx<6>{N, H, W, C, K, K}.bind<true>(scratch);
+        if (pointwise()) return;
+        auto aData = DimIdx<6>{N, C, S, S, Hq, Wq}.bind(dptr);
+        auto aScratch = DimIdx<6>{N, OH, OW, C, K, K}.bind<true>(scratch);
         FOR1 (in, 0, N)
         FOR1 (ic, 0, C)
-        FOR1 (ih, 0, H)
-        FOR1 (iw, 0, W)
+        FOR1 (oh, 0, OH)
+        FOR1 (ow, 0, OW)
         FOR1 (kh, 0, K)
         FOR1 (kw, 0, K)
-            aScratch(in, ih, iw, ic, kh, kw) = aData(in, ic, ih + kh, iw + kw);
+            aScratch(in, oh, ow, ic, kh, kw) =
+                aData(in, ic, kh % S, kw % S, oh + kh / S, ow + kw / S);
+    }
+
+    // c[F x HW] = weight[F x Kd] * op(b), one image
+    virtual void gemm_wx(CBLAS_TRANSPOSE transb, int Kd,
+                         const float *b, int ldb, float *c) {
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, transb,
+                F, OH * OW, Kd, 1, wptr, Kd, b, ldb, 0, c, OH * OW);
     }
 
     void compute_kernel() {
-        int CKK = C * K * K, HW = H * W;
-        FOR1 (in, 0, N) {
+        int CKK = C * K * K, HW = OH * OW;
+        if (pointwise()) {
+            // channel planes are S*S phases apart, which is just a leading dim
+            int ldd = S * S * Hq * Wq;
+            FOR1 (in, 0, N)
+                gemm_wx(CblasNoTrans, C, dptr + in * C * ldd, ldd,
+                        result.data() + in * F * HW);
+            return;
+        }
+        FOR1 (in, 0, N)
+            gemm_wx(CblasTrans, CKK, scratch.data() + in * CKK * HW, CKK,
+                    result.data() + in * F * HW);
+    }
+};
+
+
+// Same GEMM with the weight panel packed once by cblas_sgemm_pack.  The
+// packed format is opaque and depends on MKL version and ISA, which is why
+// both are part of the cache key.
+class NCHWMklPackGemmConv: public NCHWMklGemmConv {
+protected:
+    CONSTSTR(impl, "mklpack")
+    bool cacheable() { return true; }
+
+    void pack_weight(const tensor_t &weight) {
+        int CKK = C * K * K, HW = OH * OW;
+        auto bytes = cblas_sgemm_pack_get_size(CblasAMatrix, F, HW, CKK);
+        this->weight.resize((bytes + sizeof(float) - 1) / sizeof(float));
+        cblas_sgemm_pack(CblasRowMajor, CblasAMatrix, CblasNoTrans,
+                F, HW, CKK, 1, weight.data(), CKK, this->weight.data());
+    }
+
+    void gemm_wx(CBLAS_TRANSPOSE transb, int Kd,
+                 const float *b, int ldb, float *c) {
+        cblas_sgemm_compute(CblasRowMajor, CblasPacked, transb,
+                F, OH * OW, Kd, wptr, Kd, b, ldb, 0, c, OH * OW);
+    }
+};
+
+
+// Helper cpus for NCHWMklPipeGemmConv: the last CB_PIPE_THREADS cpus of
+// the calling team's order, which its GEMM leaves free.  Under CB_NUMA=2
+// or CB_STREAMS that is the node's or stream's own team.
+inline std::vector<int> pipe_cpus() {
+    auto cpus = numa::team_cpus();
+    int total = std::min<int>(numa::max_threads(), cpus.size());
+    int helpers = std::min(total, std::max(1,
+            env_or("CB_PIPE_THREADS", total / 4)));
+    return std::vector<int>(cpus.begin() + total - helpers,
+                            cpus.begin() + total);
+}
+
+
+// NCHWMklGemmConv over chunks of output rows (or whole images when they
+// fit) with two scratch buffers capped at CB_SCRATCH_MB in total.  While
+// the GEMM consumes one buffer the helper team runs im2col into the other;
+// only the first chunk's im2col is left on the critical path.  Each
+// instance owns its helper team, made by the first run on the team that
+// runs it, see pipe_cpus.
+class NCHWMklPipeGemmConv: public NCHWMklGemmConv {
+protected:
+    struct Chunk { int n0, n1, oh0, oh1; };
+    std::vector<Chunk> chunks;
+    tensor_t buf[2];
+    std::unique_ptr<numa::PinnedTeam> helper;
+
+    CONSTSTR(alg, "pipegemm")
+
+    void plan() {
+        std::size_t cap = env_or("CB_SCRATCH_MB", 32.0) * (1 << 20);
+        std::size_t rowsize = std::size_t(OW) * C * K * K;
+        int rows = std::max<std::size_t>(1, cap / 2 / (rowsize * sizeof(float)));
+        if (rows >= OH) {
+            int imgs = std::min(N, rows / OH);
+            for (int n0 = 0; n0 < N; n0 += imgs)
+                chunks.push_back({n0, std::min(N, n0 + imgs), 0, OH});
+            rows = imgs * OH;
+        } else {
+            FOR1 (in, 0, N)
+            for (int oh0 = 0; oh0 < OH; oh0 += rows)
+                chunks.push_back({in, in + 1, oh0, std::min(OH, oh0 + rows)});
+        }
+        buf[0].resize(rows * rowsize);
+        buf[1].resize(rows * rowsize);
+        auto cpus = pipe_cpus();
+        helper.reset(new numa::PinnedTeam(cpus, cpus.size()));
+    }
+
+    void fill(const Chunk &c, float *dst) {
+        auto aData = DimIdx<6>{N, C, S, S, Hq, Wq}.bind(dptr);
+        int rows = c.oh1 - c.oh0, CKK = C * K * K;
+        #pragma omp parallel
+        {
+            TRACE_SCOPE("pipe_fill");
+            #pragma omp for collapse(2) nowait
+            FOR1 (in, c.n0, c.n1)
+            FOR1 (oh, c.oh0, c.oh1)
+            {
+                float *out = dst + std::size_t((in - c.n0) * rows + oh - c.oh0) * OW * CKK;
+                FOR1 (ow, 0, OW)
+                FOR1 (ic, 0, C)
+                FOR1 (kh, 0, K)
+                FOR1 (kw, 0, K)
+                    *out++ = aData(in, ic, kh % S, kw % S, oh + kh / S, ow + kw / S);
+            }
+        }
+    }
+
+    void gemm(const Chunk &c, const float *src) {
+        TRACE_SCOPE("pipe_gemm");
+        int CKK = C * K * K, HW = OH * OW, rows = c.oh1 - c.oh0;
+        FOR1 (in, c.n0, c.n1) {
             cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
-                    F, HW, CKK, 1, weight.data(), CKK,
-                    scratch.data() + in * CKK * HW, CKK,
-                    0, result.data() + in * F * HW, HW);
+                    F, rows * OW, CKK, 1, wptr, CKK,
+                    src + std::size_t(in - c.n0) * rows * OW * CKK, CKK,
+                    0, result.data() + std::size_t(in) * F * HW + c.oh0 * OW, HW);
+        }
+    }
+
+    void im2col() {
+        if (pointwise()) return;
+        if (chunks.empty()) plan();
+        fill(chunks[0], buf[0].data());
+    }
+
+    void compute_kernel() {
+        if (pointwise()) return NCHWMklGemmConv::compute_kernel();
+        mkl_set_num_threads_local(std::max(1, numa::max_threads() - helper->size()));
+        FOR1 (i, 0, int(chunks.size())) {
+            if (i + 1 < int(chunks.size())) {
+                float *next = buf[(i + 1) % 2].data();
+                helper->submit([=] { fill(chunks[i + 1], next); });
+            }
+            gemm(chunks[i], buf[i % 2].data());
+            TRACE_SCOPE("pipe_wait");
+            helper->wait();
+        }
+        mkl_set_num_threads_local(0);
+    }
+};
+
+
+// Sums bufs[1 .. n) into bufs[0], len floats each, pairwise: level s adds
+// bufs[i + s] into bufs[i] for i a multiple of 2s.  The tree only depends
+// on n, so the rounding is the same from run to run whatever the thread
+// schedule.  Each thread takes blocks of 1024 floats and runs the whole
+// tree on one block while it is in cache.
+inline void tree_reduce(float *const *bufs, int n, std::size_t len) {
+    if (n <= 1) return;
+    const std::size_t block = 1024;
+    std::size_t nblk = (len + block - 1) / block;
+    #pragma omp parallel for
+    for (std::size_t ib = 0; ib < nblk; ib++) {
+        std::size_t b0 = ib * block, b1 = std::min(len, b0 + block);
+        for (int s = 1; s < n; s *= 2)
+        for (int i = 0; i + s < n; i += 2 * s)
+        Range<std::size_t>(b0, b1).vectorize().foreach([&] (std::size_t j, simd::Mask m) {
+            (VecF::load(bufs[i] + j, m) + VecF::load(bufs[i + s] + j, m))
+                .store(bufs[i] + j, m);
+        });
+    }
+}
+
+
+// Latency-oriented GEMM for small batches, where one GEMM per image leaves
+// cores idle.  The output is cut into tiles of up to 64 channels by 256
+// pixels of one image (pixel blocks halve down to 64 while there are fewer
+// tiles than threads), each a sequential GEMM on one thread.  If that is
+// still short of the team, C*K*K is split as well, every split but the
+// first writing a partial output that tree_reduce adds up afterwards.
+class NCHWMklTileConv: public NCHWMklGemmConv {
+protected:
+    int fb, pb, ksplit;
+    tensor_t partial;
+    // output of each split: result, then the partials
+    std::vector<float*> bufs;
+
+    CONSTSTR(alg, "tilegemm")
+
+    int tiles() const {
+        return N * ((F + fb - 1) / fb) * ((OH * OW + pb - 1) / pb);
+    }
+
+    // tile sizes and split count for nt threads and a depth of Kd
+    virtual void plan_tiles(int nt, int Kd) {
+        fb = std::min(F, 64);
+        pb = std::min(OH * OW, 256);
+        while (tiles() < nt && pb > 64) pb /= 2;
+        ksplit = std::max(1, std::min(nt / tiles(), Kd / 256));
+    }
+
+    void plan() {
+        plan_tiles(numa::max_threads(), pointwise() ? C : C * K * K);
+        std::size_t NFHW = std::size_t(N) * F * OH * OW;
+        partial.resize((ksplit - 1) * NFHW);
+        bufs.assign(1, result.data());
+        FOR1 (ks, 1, ksplit) bufs.push_back(partial.data() + (ks - 1) * NFHW);
+    }
+
+    void im2col() {
+        if (pointwise()) return;
+        auto aData = DimIdx<6>{N, C, S, S, Hq, Wq}.bind(dptr);
+        auto aScratch = DimIdx<6>{N, OH, OW, C, K, K}.bind<true>(scratch);
+        #pragma omp parallel
+        {
+            TRACE_SCOPE("tile_im2col");
+            #pragma omp for collapse(2) nowait
+            FOR1 (in, 0, N)
+            FOR1 (oh, 0, OH)
+            FOR1 (ow, 0, OW)
+            FOR1 (ic, 0, C)
+            FOR1 (kh, 0, K)
+            FOR1 (kw, 0, K)
+                aScratch(in, oh, ow, ic, kh, kw) =
+                    aData(in, ic, kh % S, kw % S, oh + kh / S, ow + kw / S);
         }
     }
+
+    void compute_kernel() {
+        int HW = OH * OW, Kd = pointwise() ? C : C * K * K;
+        int ldd = S * S * Hq * Wq, nf = (F + fb - 1) / fb, np = (HW + pb - 1) / pb;
+        std::size_t NFHW = std::size_t(N) * F * HW;
+        #pragma omp parallel
+        {
+            TRACE_SCOPE("tile_gemm");
+            mkl_set_num_threads_local(1);
+            #pragma omp for nowait
+            FOR1 (it, 0, tiles() * ksplit) {
+                int ks = it % ksplit, ip = it / ksplit % np;
+                int jf = it / ksplit / np % nf, in = it / ksplit / np / nf;
+                int f0 = jf * fb, fn = std::min(fb, F - f0);
+                int p0 = ip * pb, pn = std::min(pb, HW - p0);
+                int k0 = Kd * ks / ksplit, kn = Kd * (ks + 1) / ksplit - k0;
+                float *c = bufs[ks] + (std::size_t(in) * F + f0) * HW + p0;
+                // pointwise B is the (0, 0) phase plane, Kd x HW with rows ldd apart
+                if (pointwise())
+                    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+                            fn, pn, kn, 1, wptr + f0 * Kd + k0, Kd,
+                            dptr + (std::size_t(in) * C + k0) * ldd + p0, ldd,
+                            0, c, HW);
+                else
+                    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                            fn, pn, kn, 1, wptr + f0 * Kd + k0, Kd,
+                            scratch.data() + (std::size_t(in) * HW + p0) * Kd + k0, Kd,
+                            0, c, HW);
+            }
+            mkl_set_num_threads_local(0);
+        }
+        TRACE_SCOPE("tile_reduce");
+        tree_reduce(bufs.data(), ksplit, NFHW);
+    }
+
+public:
+    void prepare_data(const cview_t &data, const tensor_t &weight) {
+        NCHWMklGemmConv::prepare_data(data, weight);
+        plan();
+    }
+};
+
+
+// Split-K for deep layers with little output per image, such as 512
+// channels at 7x7, where C*K*K = 4608 dwarfs the 49 pixels: the tile
+// conv with an image's whole F x OH*OW output as one tile.  While there
+// are fewer images than threads, the C*K*K reduction of each is cut into
+// ksplit slices; with enough images it is the per-image GEMM of the base
+// class.
+class NCHWMklSplitKConv: public NCHWMklTileConv {
+protected:
+    CONSTSTR(alg, "splitkgemm")
+
+    // slices no thinner than 256 so each GEMM stays compute bound
+    void plan_tiles(int nt, int Kd) {
+        fb = F;
+        pb = OH * OW;
+        ksplit = N >= nt ? 1 : std::max(1, std::min((nt + N - 1) / N, Kd / 256));
+    }
+
+    void compute_kernel() {
+        if (ksplit == 1) return NCHWMklGemmConv::compute_kernel();
+        NCHWMklTileConv::compute_kernel();
+    }
 };
 
 
@@ -146,85 +673,280 @@ protected:
     CONSTSTR(fmt, "NHWc")
 
     void im2col() {
-        auto aScratch = DimIdx<6>{N, H, W, K, K, C}.bind<true>(scratch);
-        auto aData = DimIdx<4>{N, H+2, W+2, C}.bind(data);
+        if (pointwise()) return;
+        auto aScratch = DimIdx<6>{N, OH, OW, K, K, C}.bind<true>(scratch);
+        auto aData = DimIdx<6>{N, S, S, Hq, Wq, C}.bind(dptr);
         FOR1 (in, 0, N)
-        FOR1 (ih, 0, H)
-        FOR1 (iw, 0, W)
+        FOR1 (oh, 0, OH)
+        FOR1 (ow, 0, OW)
         FOR1 (kh, 0, K)
         FOR1 (kw, 0, K)
+        Range<int>(0, C).vectorize().foreach([&] (int ic, simd::Mask m) {
+            VecF::load(&aData(in, kh % S, kw % S, oh + kh / S, ow + kw / S, ic), m)
+                .store(&aScratch(in, oh, ow, kh, kw, ic), m);
+        });
+    }
+
+    bool cacheable() { return true; }
+
+    // rows per GEMM: the (0, 0) phase plane of an image is a dense HW x C
+    // matrix for pointwise layers, and at stride 1 the whole batch is one
+    int gemm_rows() const {
+        return (pointwise() && S != 1) ? OH * OW : N * OH * OW;
+    }
+
+    void pack_weight(const tensor_t &weight) {
+        auto wOrig = DimIdx<4>{F, C, K, K}.bind(weight);
+        auto wNew = DimIdx<4>{F, K, K, C}.bind<true>(this->weight);
+        FOR1 (jf, 0, F)
         FOR1 (ic, 0, C)
-            aScratch(in, ih, iw, kh, kw, ic) = aData(in, ih + kh, iw + kw, ic);
+        FOR1 (kh, 0, K)
+        FOR1 (kw, 0, K)
+            wNew(jf, kh, kw, ic) = wOrig(jf, ic, kh, kw);
     }
 
-    void compute_kernel() {
-        int CKK = C * K * K, NHW = N * H * W;
+    // c[M x F] = a[M x Kd] * weight^T
+    virtual void gemm_xw(int M, int Kd, const float *a, float *c) {
         cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
-                NHW, F, CKK, 1, scratch.data(), CKK,
-                weight.data(), CKK,
-                0, result.data(), F);
+                M, F, Kd, 1, a, Kd, wptr, Kd, 0, c, F);
+    }
+
+    void compute_kernel() {
+        int CKK = C * K * K, rows = gemm_rows();
+        if (pointwise()) {
+            int ldd = S * S * Hq * Wq * C;
+            FOR1 (in, 0, N * OH * OW / rows)
+                gemm_xw(rows, C, dptr + in * ldd,
+                        result.data() + in * rows * F);
+            return;
+        }
+        gemm_xw(rows, CKK, scratch.data(), result.data());
     }
 
 public:
-    void prepare_data(const tensor_t &data, const tensor_t &weight) {
-        auto dOrig = DimIdx<4>{N, C, H, W}.bind(data);
-        auto dNew = DimIdx<4>{N, H+2, W+2, C}.bind<true>(this->data);
+    // an unpadded stride-1 NHWC input needs no transposition either
+    void load_input(const cview_t &src) {
+        if (P == 0 && S == 1 && src.dense(Layout::NHWC)) {
+            dptr = src.data;
+            return;
+        }
+        auto dNew = DimIdx<6>{N, S, S, Hq, Wq, C}.bind<true>(this->data);
         FOR1 (in, 0, N)
         FOR1 (ic, 0, C)
         FOR1 (ih, 0, H)
         FOR1 (iw, 0, W)
-            dNew(in, ih+1, iw+1, ic) = dOrig(in, ic, ih, iw);
-        
-        auto wOrig = DimIdx<4>{F, C, K, K}.bind(weight);
-        auto wNew = DimIdx<4>{F, K, K, C}.bind<true>(this->weight);
+        {
+            int ph = ih + P, pw = iw + P;
+            dNew(in, ph % S, pw % S, ph / S, pw / S, ic) = src(in, ic, ih, iw);
+        }
+        dptr = this->data.data();
+    }
+
+    void store_result(const view_t &dst) {
+        auto aNHWC = DimIdx<4>{N, OH, OW, F}.bind(result);
+        FOR1 (in, 0, N)
+        FOR1 (oh, 0, OH)
+        FOR1 (ow, 0, OW)
+        FOR1 (jf, 0, F)
+            dst(in, jf, oh, ow) = aNHWC(in, oh, ow, jf);
+    }
+
+    tensor_t get_result() {
+        tensor_t nchwresult(result.size());
+        store_result(make_view(nchwresult.data(), N, F, OH, OW));
+        return nchwresult;
+    }
+
+    bool converts_result() { return true; }
+};
+
+
+class NHWCMklPackGemmConv: public NHWCMklGemmConv {
+protected:
+    CONSTSTR(impl, "mklpack")
+
+    void pack_weight(const tensor_t &weight) {
+        NHWCMklGemmConv::pack_weight(weight);
+        tensor_t fkkc;
+        fkkc.swap(this->weight);
+        int CKK = C * K * K, rows = gemm_rows();
+        auto bytes = cblas_sgemm_pack_get_size(CblasBMatrix, rows, F, CKK);
+        this->weight.resize((bytes + sizeof(float) - 1) / sizeof(float));
+        cblas_sgemm_pack(CblasRowMajor, CblasBMatrix, CblasTrans,
+                rows, F, CKK, 1, fkkc.data(), CKK, this->weight.data());
+    }
+
+    void gemm_xw(int M, int Kd, const float *a, float *c) {
+        cblas_sgemm_compute(CblasRowMajor, CblasNoTrans, CblasPacked,
+                M, F, Kd, a, Kd, wptr, Kd, 0, c, F);
+    }
+};
+
+
+// Batch-interleaved NHWCn: the batch is cut into blocks of L = VecF::width
+// images (16 on AVX-512, 8 on AVX2) that fill the lanes of a register, so
+// each (pixel, channel) is one vector over L images and every FMA reuses
+// a broadcast weight L times.  Input is (N/L, S, S, Hq, Wq, C, L) in the
+// usual phase-decomposed padding, output (N/L, OH, OW, F, L), and images
+// past N in the last block are zero.  compute_kernel keeps an RW x RF
+// tile of (ow, f) accumulators in registers over the whole C*K*K
+// reduction, which suits the small-spatial, many-channel layers where
+// vectorizing along OW or F leaves short rows or long chains.
+class NHWCnDirectConv: public NCHWDirectConv {
+protected:
+    static const int L = VecF::width;
+    // register tile of RW outputs by RF filters
+    static const int RW = L == 16 ? 4 : 2, RF = L == 16 ? 6 : 4;
+    int NB;
+
+    const char *fmt() {
+        return L == 16 ? "NHWCn16" : L == 8 ? "NHWCn8" : "NHWCn1";
+    }
+    CONSTSTR(alg, "direct")
+    CONSTSTR(impl, "batchsimd")
+
+    void pack_weight(const tensor_t &weight) {
+        auto aOrig = DimIdx<4>{F, C, K, K}.bind(weight);
+        auto aNew = DimIdx<4>{K, K, C, F}.bind<true>(this->weight);
         FOR1 (jf, 0, F)
         FOR1 (ic, 0, C)
         FOR1 (kh, 0, K)
         FOR1 (kw, 0, K)
-            wNew(jf, kh, kw, ic) = wOrig(jf, ic, kh, kw);
+            aNew(kh, kw, ic, jf) = aOrig(jf, ic, kh, kw);
     }
 
-    tensor_t get_result() {
-        tensor_t nchwresult;
-        auto aNHWC = DimIdx<4>{N, H, W, F}.bind(result);
-        auto aNCHW = DimIdx<4>{N, F, H, W}.bind<true>(nchwresult);
+    // outputs ow .. ow + R - 1 of filters jf .. jf + Q - 1 in one row
+    template <int R, int Q>
+    void tile(int nb, int oh, int ow, int jf) {
+        auto aData = DimIdx<7>{NB, S, S, Hq, Wq, C, L}.bind(dptr);
+        auto aWeight = DimIdx<4>{K, K, C, F}.bind(wptr);
+        auto aRet = DimIdx<5>{NB, OH, OW, F, L}.bind(result);
+        const auto full = simd::Mask::first(L);
+        VecF acc[R][Q];
+        FOR1 (r, 0, R)
+        FOR1 (q, 0, Q)
+            acc[r][q] = VecF::zero();
+        FOR1 (kh, 0, K)
+        FOR1 (kw, 0, K) {
+            const float *x = &aData(nb, kh % S, kw % S, oh + kh / S, ow + kw / S, 0, 0);
+            const float *w = &aWeight(kh, kw, 0, jf);
+            FOR1 (ic, 0, C) {
+                VecF xv[R];
+                FOR1 (r, 0, R) xv[r] = VecF::load(x + (r * C + ic) * L, full);
+                FOR1 (q, 0, Q) {
+                    auto wv = VecF::broadcast(w[ic * F + q]);
+                    FOR1 (r, 0, R) acc[r][q] = fmadd(wv, xv[r], acc[r][q]);
+                }
+            }
+        }
+        FOR1 (r, 0, R)
+        FOR1 (q, 0, Q)
+            acc[r][q].store(&aRet(nb, oh, ow + r, jf + q, 0), full);
+    }
+
+    template <int R>
+    void tile_row(int nb, int oh, int ow, int jf0, int jf1) {
+        int jf = jf0;
+        for (; jf + RF <= jf1; jf += RF) tile<R, RF>(nb, oh, ow, jf);
+        for (; jf < jf1; jf++) tile<R, 1>(nb, oh, ow, jf);
+    }
+
+    void compute_kernel() {
+        // a block of filters per task, so that one image block still
+        // spreads over the team
+        int FB = 8 * RF, nfb = (F + FB - 1) / FB;
+        #pragma omp parallel
+        {
+            TRACE_SCOPE("batchsimd");
+            #pragma omp for collapse(3) nowait
+            FOR1 (nb, 0, NB)
+            FOR1 (oh, 0, OH)
+            FOR1 (fb, 0, nfb) {
+                int jf0 = fb * FB, jf1 = std::min(F, jf0 + FB), ow = 0;
+                for (; ow + RW <= OW; ow += RW) tile_row<RW>(nb, oh, ow, jf0, jf1);
+                for (; ow < OW; ow++) tile_row<1>(nb, oh, ow, jf0, jf1);
+            }
+        }
+    }
+
+public:
+    void prepare_data(const cview_t &data, const tensor_t &weight) {
+        NB = (N + L - 1) / L;
+        result.resize(std::size_t(NB) * OH * OW * F * L);
+        NCHWDirectConv::prepare_data(data, weight);
+    }
+
+    // reorder from a view in any layout into NHWCn
+    void load_input(const cview_t &src) {
+        auto aNew = DimIdx<7>{NB, S, S, Hq, Wq, C, L}.bind<true>(this->data);
         FOR1 (in, 0, N)
         FOR1 (ih, 0, H)
         FOR1 (iw, 0, W)
-        FOR1 (ic, 0, F)
-            aNCHW(in, ic, ih, iw) = aNHWC(in, ih, iw, ic);
+        FOR1 (ic, 0, C)
+        {
+            int ph = ih + P, pw = iw + P;
+            aNew(in / L, ph % S, pw % S, ph / S, pw / S, ic, in % L) = src(in, ic, ih, iw);
+        }
+        dptr = this->data.data();
+    }
+
+    // and back, dropping the zero images of the last block
+    void store_result(const view_t &dst) {
+        auto aRet = DimIdx<5>{NB, OH, OW, F, L}.bind(result);
+        FOR1 (in, 0, N)
+        FOR1 (jf, 0, F)
+        FOR1 (oh, 0, OH)
+        FOR1 (ow, 0, OW)
+            dst(in, jf, oh, ow) = aRet(in / L, oh, ow, jf, in % L);
+    }
+
+    tensor_t get_result() {
+        tensor_t nchwresult(std::size_t(N) * F * OH * OW);
+        store_result(make_view(nchwresult.data(), N, F, OH, OW));
         return nchwresult;
     }
+
+    bool converts_result() { return true; }
 };
 
+
 class NCHWMklSpGemmConv: public NCHWMklGemmConv {
 protected:
     std::vector<int> ptrB, ptrE, wcols;
     std::unique_ptr<sparse_matrix_t> spweight;
     tensor_t wvals;
     float sprate;
+    // CSR arrays handed to MKL, owned by the vectors above or by wcache
+    int *rowB, *rowE, *cols;
+    float *vals;
 
     CONSTSTR(spfmt, "csr")
     float sparsity() { return sprate; }
 
     void im2col() {
-        auto aScratch = DimIdx<6>{N, C, K, K, H, W}.bind<true>(scratch);
-        auto aData = DimIdx<4>{N, C, H+2, W+2}.bind(data);
+        if (pointwise()) return;
+        auto aScratch = DimIdx<6>{N, C, K, K, OH, OW}.bind<true>(scratch);
+        auto aData = DimIdx<6>{N, C, S, S, Hq, Wq}.bind(dptr);
         FOR1 (in, 0, N)
         FOR1 (ic, 0, C)
-        FOR1 (ih, 0, H)
-        FOR1 (iw, 0, W)
         FOR1 (kh, 0, K)
         FOR1 (kw, 0, K)
-            aScratch(in, ic, kh, kw, ih, iw) = aData(in, ic, ih + kh, iw + kw);
+        FOR1 (oh, 0, OH)
+        Range<int>(0, OW).vectorize().foreach([&] (int ow, simd::Mask m) {
+            VecF::load(&aData(in, ic, kh % S, kw % S, oh + kh / S, ow + kw / S), m)
+                .store(&aScratch(in, ic, kh, kw, oh, ow), m);
+        });
     }
 
     void compute_kernel() {
-        int CKK = C * K * K, HW = H * W;
+        int CKK = C * K * K, HW = OH * OW;
+        // pointwise reads the phase planes in place, see NCHWMklGemmConv
+        const float *src = pointwise() ? dptr : scratch.data();
+        int ldb = pointwise() ? S * S * Hq * Wq : HW;
         FOR1 (in, 0, N) {
             auto status = mkl_sparse_s_mm(SPARSE_OPERATION_NON_TRANSPOSE, 1, *(spweight.get()),
                 {SPARSE_MATRIX_TYPE_GENERAL}, SPARSE_LAYOUT_ROW_MAJOR,
-                scratch.data() + in * CKK * HW, HW, HW,
+                src + in * CKK * ldb, HW, ldb,
                 0, result.data() + in * F * HW, HW);
             assert (status == SPARSE_STATUS_SUCCESS);
         }
@@ -232,34 +954,436 @@ protected:
 
 public:
     void sparsity(float s) {
+        TRACE_SCOPE("sparsity");
         sprate = s;
         spweight.reset(new sparse_matrix_t());
         ptrB.clear(); ptrE.clear(); wcols.clear();
         wvals.clear();
         int CKK = C * K * K;
-        FOR1 (jf, 0, F) {
-            ptrB.push_back(wcols.size());
-            tensor_t currow(weight.begin() + CKK*jf,
-                            weight.begin() + CKK*jf + CKK);
-            std::sort(currow.begin(), currow.end());
-            auto flag = currow[sprate * CKK];
-            FOR1 (jckk, 0, CKK) {
-                auto curval = weight[jf * CKK + jckk];
-                if (curval > flag) {
-                    wvals.push_back(curval);
-                    wcols.push_back(jckk);
+        // persisted as ptrB | ptrE | wcols | wvals, all 4-byte words
+        std::vector<int> packed;
+        std::size_t size = 0;
+        auto blob = (int*) fetch_packed(weight, size, [&] {
+            FOR1 (jf, 0, F) {
+                ptrB.push_back(wcols.size());
+                // at sparsity 0 the weights stay as given, less their zeros
+                bool prune = sprate > 0;
+                auto flag = prune ? row_threshold(&weight[CKK * jf], CKK, sprate) : 0;
+                FOR1 (jckk, 0, CKK) {
+                    auto curval = weight[jf * CKK + jckk];
+                    if (prune ? curval > flag : curval != 0) {
+                        wvals.push_back(curval);
+                        wcols.push_back(jckk);
+                    }
                 }
+                ptrE.push_back(wcols.size());
+            }
+            if (wcache) {
+                packed = ptrB;
+                packed.insert(packed.end(), ptrE.begin(), ptrE.end());
+                packed.insert(packed.end(), wcols.begin(), wcols.end());
+                packed.resize(packed.size() + wvals.size());
+                std::memcpy(packed.data() + packed.size() - wvals.size(),
+                            wvals.data(), wvals.size() * sizeof(float));
             }
-            ptrE.push_back(wcols.size());
+            return std::make_pair((const void*) packed.data(),
+                                  packed.size() * sizeof(int));
+        });
+        if (blob) {
+            int nnz = size / sizeof(int) / 2 - F;
+            rowB = blob; rowE = blob + F; cols = blob + 2 * F;
+            vals = (float*) (blob + 2 * F + nnz);
+        } else {
+            rowB = ptrB.data(); rowE = ptrE.data(); cols = wcols.data();
+            vals = wvals.data();
         }
         auto status = mkl_sparse_s_create_csr(
             spweight.get(), SPARSE_INDEX_BASE_ZERO, F, CKK,
-            ptrB.data(), ptrE.data(), wcols.data(), wvals.data());
+            rowB, rowE, cols, vals);
         assert(status == SPARSE_STATUS_SUCCESS);
     }
 };
 
 
+// Skips zero activations instead of zero weights.  im2col compresses each
+// padded input row (n, c, phase, hq) to its nonzeros at run time, so empty
+// channels and pixels cost nothing; compute_kernel then walks, per output
+// row, the nonzeros under every tap and adds value * weight column along
+// F, with the weights repacked to (C, K, K, F).  A row accumulates in an
+// OW x F buffer per thread before it is transposed into the NCHW result.
+// sparsity() is the zero fraction of the last input seen.
+class NCHWActSparseConv: public NCHWDirectConv {
+protected:
+    std::vector<int> rowptr, cols;
+    tensor_t vals, rowbuf;
+    float zerorate;
+
+    CONSTSTR(impl, "actskip")
+    CONSTSTR(spfmt, "actcsr")
+    float sparsity() { return zerorate; }
+
+    void pack_weight(const tensor_t &weight) {
+        auto aOrig = DimIdx<4>{F, C, K, K}.bind(weight);
+        auto aNew = DimIdx<4>{C, K, K, F}.bind<true>(this->weight);
+        FOR1 (jf, 0, F)
+        FOR1 (ic, 0, C)
+        FOR1 (kh, 0, K)
+        FOR1 (kw, 0, K)
+            aNew(ic, kh, kw, jf) = aOrig(jf, ic, kh, kw);
+    }
+
+    void im2col() {
+        int rows = rowptr.size() - 1;
+        #pragma omp parallel for
+        FOR1 (r, 0, rows) {
+            int cnt = 0;
+            FOR1 (wq, 0, Wq) cnt += dptr[std::size_t(r) * Wq + wq] != 0;
+            rowptr[r + 1] = cnt;
+        }
+        FOR1 (r, 0, rows) rowptr[r + 1] += rowptr[r];
+        #pragma omp parallel for
+        FOR1 (r, 0, rows) {
+            int j = rowptr[r];
+            FOR1 (wq, 0, Wq) {
+                float v = dptr[std::size_t(r) * Wq + wq];
+                if (v == 0) continue;
+                cols[j] = wq;
+                vals[j++] = v;
+            }
+        }
+        zerorate = 1 - rowptr[rows] / (double(N) * C * H * W);
+    }
+
+    void compute_kernel() {
+        auto aWeight = DimIdx<4>{C, K, K, F}.bind(wptr);
+        auto aRet = DimIdx<4>{N, F, OH, OW}.bind(result);
+        #pragma omp parallel
+        {
+            TRACE_SCOPE("actskip");
+            float *acc = rowbuf.data() + std::size_t(omp_get_thread_num()) * OW * F;
+            #pragma omp for collapse(2) nowait
+            FOR1 (in, 0, N)
+            FOR1 (oh, 0, OH) {
+                std::fill(acc, acc + OW * F, 0.0f);
+                FOR1 (ic, 0, C)
+                FOR1 (kh, 0, K)
+                FOR1 (pw, 0, S) {
+                    int r = (((in * C + ic) * S + kh % S) * S + pw) * Hq + oh + kh / S;
+                    FOR1 (j, rowptr[r], rowptr[r + 1])
+                    for (int kw = pw; kw < K; kw += S) {
+                        int ow = cols[j] - kw / S;
+                        if (ow < 0 || ow >= OW) continue;
+                        auto x = VecF::broadcast(vals[j]);
+                        const float *w = &aWeight(ic, kh, kw, 0);
+                        float *out = acc + ow * F;
+                        Range<int>(0, F).vectorize().foreach([&] (int jf, simd::Mask m) {
+                            fmadd(x, VecF::load(w + jf, m), VecF::load(out + jf, m))
+                                .store(out + jf, m);
+                        });
+                    }
+                }
+                FOR1 (jf, 0, F)
+                FOR1 (ow, 0, OW)
+                    aRet(in, jf, oh, ow) = acc[ow * F + jf];
+            }
+        }
+    }
+
+public:
+    NCHWActSparseConv(): zerorate(0) {}
+
+    void prepare_data(const cview_t &data, const tensor_t &weight) {
+        NCHWDirectConv::prepare_data(data, weight);
+        rowptr.assign(std::size_t(N) * C * S * S * Hq + 1, 0);
+        cols.resize(std::size_t(N) * C * S * S * Hq * Wq);
+        vals.resize(cols.size());
+        rowbuf.resize(std::size_t(numa::max_threads()) * OW * F);
+    }
+};
+
+
+// Backward passes share the forward setup: check_size and prepare_data
+// lay out the input and weights as usual, and the output gradient dY is a
+// synthetic N x F x OH x OW tensor filled like the input.
+class NCHWMklBwdDataConv: public NCHWMklGemmConv {
+protected:
+    tensor_t grad, padded;
+
+    CONSTSTR(alg, "gemm_bwd_data")
+
+    // nothing to gather, the scatter back happens in compute_kernel
+    void im2col() {}
+
+    // dX = col2im(W^T * dY), accumulated in the phase layout and cropped
+    void compute_kernel() {
+        int CKK = C * K * K, HW = OH * OW, ldd = S * S * Hq * Wq;
+        if (pointwise()) {
+            // only the (0, 0) planes are touched, the others stay zero
+            FOR1 (in, 0, N)
+                cblas_sgemm(CblasRowMajor, CblasTrans, CblasNoTrans,
+                        C, HW, F, 1, wptr, C, grad.data() + in * F * HW, HW,
+                        0, padded.data() + in * C * ldd, ldd);
+        } else {
+            cblas_sgemm(CblasRowMajor, CblasTrans, CblasNoTrans,
+                    CKK, N * HW, F, 1, wptr, CKK, grad.data(), N * HW,
+                    0, scratch.data(), N * HW);
+            // scratch is CKK x N x HW, see prepare_data
+            auto aScratch = DimIdx<6>{C, K, K, N, OH, OW}.bind(scratch);
+            auto aPad = DimIdx<6>{N, C, S, S, Hq, Wq}.bind(padded);
+            #pragma omp parallel
+            {
+                TRACE_SCOPE("col2im");
+                #pragma omp for collapse(2) nowait
+                FOR1 (in, 0, N)
+                FOR1 (ic, 0, C)
+                {
+                    std::fill_n(&aPad(in, ic, 0, 0, 0, 0), ldd, 0.f);
+                    FOR1 (kh, 0, K)
+                    FOR1 (kw, 0, K)
+                    FOR1 (oh, 0, OH)
+                    Range<int>(0, OW).vectorize().foreach([&] (int ow, simd::Mask m) {
+                        float *dst = &aPad(in, ic, kh % S, kw % S, oh + kh / S, ow + kw / S);
+                        (VecF::load(dst, m) + VecF::load(&aScratch(ic, kh, kw, in, oh, ow), m))
+                            .store(dst, m);
+                    });
+                }
+            }
+        }
+        auto aPad = DimIdx<6>{N, C, S, S, Hq, Wq}.bind(padded);
+        auto aRet = DimIdx<4>{N, C, H, W}.bind(result);
+        #pragma omp parallel
+        {
+            TRACE_SCOPE("crop");
+            #pragma omp for collapse(2) nowait
+            FOR1 (in, 0, N)
+            FOR1 (ic, 0, C)
+            FOR1 (ih, 0, H)
+            FOR1 (iw, 0, W)
+            {
+                int ph = ih + P, pw = iw + P;
+                aRet(in, ic, ih, iw) = aPad(in, ic, ph % S, pw % S, ph / S, pw / S);
+            }
+        }
+    }
+
+public:
+    // naive dX from the same dY and weights, scattered tap by tap
+    tensor_t reference() {
+        tensor_t ret(std::size_t(N) * C * H * W);
+        auto aW = DimIdx<4>{F, C, K, K}.bind(wptr);
+        auto aRet = DimIdx<4>{N, C, H, W}.bind(ret);
+        int HW = OH * OW;
+        #pragma omp parallel for collapse(2)
+        FOR1 (in, 0, N)
+        FOR1 (ic, 0, C)
+        FOR1 (jf, 0, F)
+        FOR1 (oh, 0, OH)
+        FOR1 (ow, 0, OW)
+        {
+            // see prepare_data for the two layouts of dY
+            float dy = grad[(pointwise() ? std::size_t(in) * F + jf
+                                         : std::size_t(jf) * N + in) * HW + oh * OW + ow];
+            FOR1 (kh, 0, K)
+            FOR1 (kw, 0, K)
+            {
+                int ih = oh * S + kh - P, iw = ow * S + kw - P;
+                if (ih >= 0 && ih < H && iw >= 0 && iw < W)
+                    aRet(in, ic, ih, iw) += dy * aW(jf, ic, kh, kw);
+            }
+        }
+        return ret;
+    }
+
+    // Besides pointwise, dY is kept as F x (N * HW) so that one GEMM covers
+    // the whole batch.
+    void prepare_data(const cview_t &data, const tensor_t &weight) {
+        NCHWMklGemmConv::prepare_data(data, weight);
+        tensor_t dy(std::size_t(N) * F * OH * OW);
+        init_rand(dy);
+        if (pointwise()) {
+            grad.swap(dy);
+        } else {
+            auto aDy = DimIdx<4>{N, F, OH, OW}.bind(dy);
+            auto aGrad = DimIdx<4>{F, N, OH, OW}.bind<true>(grad);
+            FOR1 (in, 0, N)
+            FOR1 (jf, 0, F)
+            FOR1 (oh, 0, OH)
+            FOR1 (ow, 0, OW)
+                aGrad(jf, in, oh, ow) = aDy(in, jf, oh, ow);
+        }
+        padded.resize(std::size_t(N) * C * S * S * Hq * Wq);
+        if (!pointwise()) scratch.resize(std::size_t(N) * C * K * K * OH * OW);
+        result.resize(std::size_t(N) * C * H * W);
+    }
+};
+
+
+// dW = sum over the batch of dY_n * col_n^T.  The batch is cut into one
+// slab per thread, each accumulating its own partial dW with sequential
+// GEMMs, and the partials are summed element-parallel afterwards.
+class NCHWMklBwdWeightConv: public NCHWMklGemmConv {
+protected:
+    tensor_t grad, partial;
+    int parts;
+
+    CONSTSTR(alg, "gemm_bwd_weight")
+
+    void compute_kernel() {
+        int CKK = C * K * K, HW = OH * OW, ldd = S * S * Hq * Wq;
+        std::size_t FCKK = std::size_t(F) * CKK;
+        // With fewer slabs than threads the spare ones go to each slab's
+        // GEMM, which MKL only threads inside a parallel region with
+        // nesting on and its dynamic adjustment off.
+        int inner = std::max(1, numa::max_threads() / parts);
+        int levels = omp_get_max_active_levels(), dynamic = mkl_get_dynamic();
+        if (inner > 1) {
+            omp_set_max_active_levels(std::max(levels, 2));
+            mkl_set_dynamic(0);
+        }
+        #pragma omp parallel for num_threads(parts)
+        FOR1 (ip, 0, parts) {
+            TRACE_SCOPE("bwd_weight_slab");
+            mkl_set_num_threads_local(inner);
+            float *acc = partial.data() + ip * FCKK;
+            FOR1 (in, N * ip / parts, N * (ip + 1) / parts) {
+                float beta = in == N * ip / parts ? 0 : 1;
+                const float *dy = grad.data() + std::size_t(in) * F * HW;
+                if (pointwise())
+                    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans,
+                            F, C, HW, 1, dy, HW, dptr + in * C * ldd,
+                            ldd, beta, acc, C);
+                else
+                    cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+                            F, CKK, HW, 1, dy, HW,
+                            scratch.data() + std::size_t(in) * HW * CKK, CKK,
+                            beta, acc, CKK);
+            }
+            mkl_set_num_threads_local(0);
+        }
+        if (inner > 1) {
+            omp_set_max_active_levels(levels);
+            mkl_set_dynamic(dynamic);
+        }
+        #pragma omp parallel
+        {
+            TRACE_SCOPE("bwd_weight_reduce");
+            // whole registers per thread, the masked tail lands on one
+            std::size_t nvec = (FCKK + VecF::width - 1) / VecF::width;
+            #pragma omp for nowait
+            for (std::size_t iv = 0; iv < nvec; iv++) {
+                std::size_t i = iv * VecF::width;
+                auto m = simd::Mask::first(std::min<std::size_t>(VecF::width, FCKK - i));
+                auto sum = VecF::zero();
+                FOR1 (ip, 0, parts) sum = sum + VecF::load(&partial[ip * FCKK + i], m);
+                sum.store(&result[i], m);
+            }
+        }
+    }
+
+public:
+    // naive dW from the same dY and input
+    tensor_t reference() {
+        tensor_t ret(std::size_t(F) * C * K * K);
+        auto aData = DimIdx<6>{N, C, S, S, Hq, Wq}.bind(dptr);
+        auto aGrad = DimIdx<4>{N, F, OH, OW}.bind(grad);
+        auto aRet = DimIdx<4>{F, C, K, K}.bind(ret);
+        #pragma omp parallel for collapse(2)
+        FOR1 (jf, 0, F)
+        FOR1 (ic, 0, C)
+        FOR1 (kh, 0, K)
+        FOR1 (kw, 0, K)
+        {
+            float sum = 0;
+            FOR1 (in, 0, N)
+            FOR1 (oh, 0, OH)
+            FOR1 (ow, 0, OW)
+                sum += aGrad(in, jf, oh, ow)
+                     * aData(in, ic, kh % S, kw % S, oh + kh / S, ow + kw / S);
+            aRet(jf, ic, kh, kw) = sum;
+        }
+        return ret;
+    }
+
+    void prepare_data(const cview_t &data, const tensor_t &weight) {
+        NCHWMklGemmConv::prepare_data(data, weight);
+        grad.resize(std::size_t(N) * F * OH * OW);
+        init_rand(grad);
+        parts = std::max(1, std::min(N, numa::max_threads()));
+        partial.resize(parts * std::size_t(F) * C * K * K);
+        result.resize(std::size_t(F) * C * K * K);
+    }
+};
+
+
+// Batch split across NUMA nodes, see CaseProvider::newSplitConv.  Each
+// phase is reported as the slowest node's time.
+template <typename ConvClass>
+class NumaSplitConv {
+    friend class CaseProvider;
+    std::vector<std::unique_ptr<ConvClass>> convs;
+
+    template <typename Fn>
+    void each(Fn fn) {
+        auto &teams = numa::node_teams();
+        FOR1 (i, 0, int(convs.size()))
+            if (convs[i]) teams[i]->submit([&, i] { fn(i, *convs[i]); });
+        for (auto &t: teams) t->wait();
+    }
+
+public:
+    void compute() {
+        if (std::count_if(convs.begin(), convs.end(),
+                          [] (const std::unique_ptr<ConvClass> &c) { return !!c; }) > 1)
+            prof::profiler().disable("CB_NUMA=2 runs the nodes at once");
+        std::vector<std::pair<double, double>> times(convs.size());
+        each([&] (int i, ConvClass &conv) { times[i] = conv.run(); });
+        std::pair<double, double> worst {0, 0};
+        for (auto &t: times) {
+            worst.first = std::max(worst.first, t.first);
+            worst.second = std::max(worst.second, t.second);
+        }
+        for (auto &conv: convs)
+            if (conv) return conv->report(worst);
+    }
+
+    void report_memory(const memstat::Usage &u) {
+        for (auto &conv: convs)
+            if (conv) return conv->report_memory(u);
+    }
+
+    void sparsity(float s) {
+        each([&] (int, ConvClass &conv) { conv.sparsity(s); });
+    }
+
+    bool converts_result() {
+        for (auto &conv: convs)
+            if (conv) return conv->converts_result();
+        return false;
+    }
+
+    tensor_t get_result() {
+        tensor_t ret;
+        for (auto &conv: convs) {
+            if (!conv) continue;
+            auto part = conv->get_result();
+            ret.insert(ret.end(), part.begin(), part.end());
+        }
+        return ret;
+    }
+
+    // for classes with a reference(), per image like get_result
+    tensor_t reference() {
+        tensor_t ret;
+        for (auto &conv: convs) {
+            if (!conv) continue;
+            auto part = conv->reference();
+            ret.insert(ret.end(), part.begin(), part.end());
+        }
+        return ret;
+    }
+};
+
+
 #undef FOR1
 #undef CONSTSTR
 
@@ -0,0 +1,149 @@
+#ifndef _TRACE_HPP_
+#define _TRACE_HPP_
+#include <string>
+
+// Scoped spans for chrome://tracing / Perfetto, compiled in with -DCB_TRACE
+// (make TRACE=1).  TRACE_SCOPE(name) records [construction, destruction)
+// of a block on the calling thread; TRACE_SCOPE_D also attaches a detail
+// string, which must outlive the trace (see trace::intern).  Without
+// CB_TRACE both expand to nothing and their arguments are never evaluated.
+//
+// Each thread appends to its own ring of CB_TRACE_EVENTS (default 65536)
+// events, so recording takes no lock; when a ring wraps the oldest events
+// are overwritten.  trace::dump writes every ring out as trace-event JSON,
+// and is meant to be called while no spans are open.
+#ifdef CB_TRACE
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <vector>
+#include <unistd.h>
+
+namespace trace {
+
+struct Event {
+    const char *name, *detail;
+    std::int64_t begin, end;  // ns
+};
+
+// single writer, the owning thread
+struct Ring {
+    std::vector<Event> events;
+    std::atomic<std::size_t> head;
+    int tid;
+
+    Ring(std::size_t size, int tid): events(size), head(0), tid(tid) {}
+
+    void push(const Event &ev) {
+        auto h = head.load(std::memory_order_relaxed);
+        events[h % events.size()] = ev;
+        head.store(h + 1, std::memory_order_release);
+    }
+};
+
+inline std::mutex &registry_mutex() {
+    static std::mutex mtx;
+    return mtx;
+}
+
+// never freed: OpenMP and helper threads may be gone by dump time
+inline std::vector<Ring*> &rings() {
+    static std::vector<Ring*> ret;
+    return ret;
+}
+
+inline Ring &local_ring() {
+    thread_local Ring *ring = [] {
+        std::lock_guard<std::mutex> lk(registry_mutex());
+        const char *s = std::getenv("CB_TRACE_EVENTS");
+        int size = (s && *s) ? std::atoi(s) : 1 << 16;
+        auto r = new Ring(std::max(1, size), rings().size());
+        rings().push_back(r);
+        return r;
+    }();
+    return *ring;
+}
+
+inline std::int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// a stable copy of str, for span details built at run time
+inline const char *intern(const std::string &str) {
+    static std::set<std::string> pool;
+    std::lock_guard<std::mutex> lk(registry_mutex());
+    return pool.insert(str).first->c_str();
+}
+
+class Span {
+    const char *name, *detail;
+    std::int64_t begin;
+
+public:
+    Span(const char *name, const char *detail = nullptr)
+        : name(name), detail(detail), begin(now_ns()) {}
+
+    ~Span() {
+        local_ring().push({name, detail, begin, now_ns()});
+    }
+};
+
+inline void dump(const std::string &path) {
+    std::lock_guard<std::mutex> lk(registry_mutex());
+    std::int64_t t0 = INT64_MAX;
+    for (auto r: rings()) {
+        auto h = r->head.load(std::memory_order_acquire);
+        auto n = std::min(h, r->events.size());
+        for (auto i = h - n; i < h; i++)
+            t0 = std::min(t0, r->events[i % r->events.size()].begin);
+    }
+    std::ofstream os(path);
+    os << "{\"traceEvents\":[\n";
+    const char *sep = "";
+    int pid = getpid();
+    for (auto r: rings()) {
+        os << sep << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << pid
+           << ",\"tid\":" << r->tid << ",\"args\":{\"name\":\"thread "
+           << r->tid << "\"}}";
+        sep = ",\n";
+        auto h = r->head.load(std::memory_order_acquire);
+        auto n = std::min(h, r->events.size());
+        for (auto i = h - n; i < h; i++) {
+            auto &ev = r->events[i % r->events.size()];
+            os << sep << "{\"ph\":\"X\",\"name\":\"" << ev.name
+               << "\",\"pid\":" << pid << ",\"tid\":" << r->tid
+               << ",\"ts\":" << (ev.begin - t0) / 1e3
+               << ",\"dur\":" << (ev.end - ev.begin) / 1e3;
+            if (ev.detail) os << ",\"args\":{\"detail\":\"" << ev.detail << "\"}";
+            os << '}';
+        }
+    }
+    os << "\n]}\n";
+}
+
+}  // end namespace
+
+#define TRACE_CAT_(a, b) a##b
+#define TRACE_CAT(a, b) TRACE_CAT_(a, b)
+#define TRACE_SCOPE(name) trace::Span TRACE_CAT(trace_span_, __LINE__)(name)
+#define TRACE_SCOPE_D(name, detail) \
+    trace::Span TRACE_CAT(trace_span_, __LINE__)(name, detail)
+
+#else
+
+namespace trace {
+inline void dump(const std::string&) {}
+}
+
+#define TRACE_SCOPE(name)
+#define TRACE_SCOPE_D(name, detail)
+
+#endif  // CB_TRACE
+
+#endif  // _TRACE_HPP_
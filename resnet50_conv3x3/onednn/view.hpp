@@ -0,0 +1,106 @@
+#ifndef _VIEW_HPP_
+#define _VIEW_HPP_
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <type_traits>
+
+// Non-owning strided view of a 4-d tensor, addressed as (n, c, h, w)
+// whatever the memory order.  The layout tag says how the strides were
+// laid down: NCHW and NHWC are plain strided, while nChw16c keeps the
+// channels in blocks of 16, strides[1] stepping blocks and the channel
+// within a block contiguous.  Batch sub-views, slices and the interior of
+// a padded buffer only move the pointer and shrink the sizes, so the conv
+// classes take their input and output as views and copy only when the
+// strides differ from their own layout, see dense().
+enum class Layout { NCHW, NHWC, nChw16c };
+
+template <typename T>
+struct TensorView {
+    T *data;
+    int sizes[4];
+    std::ptrdiff_t strides[4];
+    Layout layout;
+
+    TensorView(): data(nullptr), sizes {0, 0, 0, 0}, strides {0, 0, 0, 0},
+                  layout(Layout::NCHW) {}
+
+    TensorView(T *data, const int *sz, const std::ptrdiff_t *st,
+               Layout layout = Layout::NCHW)
+        : data(data), sizes {sz[0], sz[1], sz[2], sz[3]},
+          strides {st[0], st[1], st[2], st[3]}, layout(layout) {}
+
+    // float views pass as const float ones
+    template <typename U, typename = typename std::enable_if<
+            std::is_convertible<U*, T*>::value>::type>
+    TensorView(const TensorView<U> &v)
+        : TensorView(v.data, v.sizes, v.strides, v.layout) {}
+
+    int cblock() const { return layout == Layout::nChw16c ? 16 : 1; }
+
+    std::ptrdiff_t offset(int n, int c, int h, int w) const {
+        int cb = cblock();
+        return n * strides[0] + c / cb * strides[1] + c % cb
+             + h * strides[2] + w * strides[3];
+    }
+
+    T &operator()(int n, int c, int h, int w) const {
+        return data[offset(n, c, h, w)];
+    }
+
+    // [start, stop) along dimension d; blocked channels are cut at blocks
+    TensorView slice(int d, int start, int stop) const {
+        assert (0 <= start && start <= stop && stop <= sizes[d]);
+        assert (d != 1 || start % cblock() == 0);
+        int at[4] = {0, 0, 0, 0};
+        at[d] = start;
+        TensorView ret = *this;
+        ret.data += offset(at[0], at[1], at[2], at[3]);
+        ret.sizes[d] = stop - start;
+        return ret;
+    }
+
+    TensorView batch(int n0, int n1) const { return slice(0, n0, n1); }
+
+    // the unpadded part of a buffer with pad rows and columns on each side
+    TensorView interior(int pad) const {
+        return slice(2, pad, sizes[2] - pad).slice(3, pad, sizes[3] - pad);
+    }
+
+    // Whether the elements sit where a dense tensor of these sizes in
+    // layout l keeps them, images apart included.  Strides of dimensions
+    // of size 1 never matter, so a single image of anything dense counts.
+    bool dense(Layout l) const {
+        if (l != layout && (l == Layout::nChw16c || layout == Layout::nChw16c))
+            return false;
+        auto want = dense_strides(sizes, l);
+        for (int d = 0; d < 4; d++)
+            if (sizes[d] > 1 && strides[d] != want[d]) return false;
+        return true;
+    }
+
+    static std::array<std::ptrdiff_t, 4> dense_strides(const int *sz, Layout l) {
+        std::ptrdiff_t C = sz[1], H = sz[2], W = sz[3];
+        switch (l) {
+        case Layout::NHWC:
+            return {{H * W * C, 1, W * C, C}};
+        case Layout::nChw16c:
+            return {{(C + 15) / 16 * H * W * 16, H * W * 16, W * 16, 16}};
+        default:
+            return {{C * H * W, H * W, W, 1}};
+        }
+    }
+};
+
+typedef TensorView<float> view_t;
+typedef TensorView<const float> cview_t;
+
+// dense N x C x H x W tensor at p in layout l; nChw16c pads C up to blocks
+template <typename T>
+TensorView<T> make_view(T *p, int N, int C, int H, int W,
+                        Layout l = Layout::NCHW) {
+    const int sz[4] = {N, C, H, W};
+    return TensorView<T>(p, sz, TensorView<T>::dense_strides(sz, l).data(), l);
+}
+
+#endif  // _VIEW_HPP_
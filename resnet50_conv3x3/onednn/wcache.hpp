@@ -0,0 +1,113 @@
+#ifndef _WCACHE_HPP_
+#define _WCACHE_HPP_
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+inline const char *isa_tag() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return "avx512";
+    if (__builtin_cpu_supports("avx2")) return "avx2";
+    return "sse";
+}
+
+// FNV-1a over 64-bit words, only used to tell whether the source weights
+// behind a cache entry have changed
+inline std::uint64_t hash_bytes(const void *ptr, std::size_t size) {
+    auto bytes = (const unsigned char*) ptr;
+    std::uint64_t h = 0xcbf29ce484222325ull, word;
+    std::size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        std::memcpy(&word, bytes + i, 8);
+        h = (h ^ word) * 0x100000001b3ull;
+    }
+    for (; i < size; i++)
+        h = (h ^ bytes[i]) * 0x100000001b3ull;
+    return h;
+}
+
+
+// Directory of packed weight blobs, one file per key.  Hits are mmap'ed
+// privately and stay mapped until the cache is destroyed, so conv objects
+// may point straight into them.
+class WeightCache {
+    struct Header {
+        char magic[8];
+        std::uint64_t srchash, size;
+        char pad[40];
+    };
+    static const char *magic() { return "CBWPACK1"; }
+
+    std::string dir;
+    std::vector<std::pair<void*, std::size_t>> maps;
+
+    std::string path(const std::string &key) const {
+        std::string name = key;
+        for (auto &ch: name)
+            if (!isalnum(ch) && ch != '-' && ch != '.') ch = '_';
+        return dir + '/' + name + ".wpk";
+    }
+
+public:
+    WeightCache(const std::string &dir): dir(dir) {
+        mkdir(dir.c_str(), 0755);
+    }
+
+    WeightCache(const WeightCache&) = delete;
+    WeightCache& operator=(const WeightCache&) = delete;
+
+    ~WeightCache() {
+        for (auto &m: maps) munmap(m.first, m.second);
+    }
+
+    // Returns the blob stored for key, or nullptr if it is missing or was
+    // packed from different source weights.
+    void *load(const std::string &key, std::uint64_t srchash, std::size_t &size) {
+        int fd = open(path(key).c_str(), O_RDONLY);
+        if (fd < 0) return nullptr;
+        struct stat st;
+        void *ptr = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(Header))
+            ptr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (ptr == MAP_FAILED) return nullptr;
+        auto hdr = (const Header*) ptr;
+        if (std::memcmp(hdr->magic, magic(), 8) || hdr->srchash != srchash ||
+                hdr->size + sizeof(Header) != (std::size_t) st.st_size) {
+            munmap(ptr, st.st_size);
+            return nullptr;
+        }
+        maps.push_back({ptr, st.st_size});
+        size = hdr->size;
+        return (char*) ptr + sizeof(Header);
+    }
+
+    void store(const std::string &key, std::uint64_t srchash,
+               const void *blob, std::size_t size) {
+        Header hdr {};
+        std::memcpy(hdr.magic, magic(), 8);
+        hdr.srchash = srchash;
+        hdr.size = size;
+        auto fn = path(key), tmpfn = fn + ".tmp";
+        {
+            std::ofstream os(tmpfn, std::ios::binary);
+            os.write((const char*) &hdr, sizeof(hdr));
+            os.write((const char*) blob, size);
+            if (!os) return;
+        }
+        std::rename(tmpfn.c_str(), fn.c_str());
+    }
+};
+
+#endif  // _WCACHE_HPP_
@@ -0,0 +1,73 @@
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include "tensorutils.hpp"
+#include "wfile.hpp"
+
+// wconvert.x fmt.txt dat.bin out.cbw [fp32|fp16|bf16] [bsize sparsity]
+// rewrites the fp32 weights of dat.bin as a .cbw file, see wfile.hpp, in
+// half precision by default and block sparse when bsize is given.  Every
+// layer is decoded back and reported with its size and the largest
+// rounding error of the values kept.  CB_WFILE_BLOCK sets the bytes per
+// checksum.
+int main(int argc, char **argv) {
+    if (argc < 4) {
+        std::cerr << "usage: " << argv[0]
+                  << " fmt.txt dat.bin out.cbw [fp32|fp16|bf16] [bsize sparsity]"
+                  << std::endl;
+        return 1;
+    }
+    std::ifstream infmt(argv[1]);
+    std::ifstream weightfile(argv[2], std::ios::binary);
+    std::string dtname = argc > 4 ? argv[4] : "fp16";
+    int dt = dtname == "fp32" ? wfile::FP32 : dtname == "bf16" ? wfile::BF16 : wfile::FP16;
+    int bsize = argc > 5 ? std::atoi(argv[5]) : 0;
+    float sparsity = argc > 6 ? std::atof(argv[6]) : 0;
+    if (dtname != wfile::dtype_name(dt) || bsize < 0 || bsize > 255
+            || sparsity < 0 || sparsity >= 1) {
+        std::cerr << "bad type, block size or sparsity" << std::endl;
+        return 1;
+    }
+    auto shapes = read_shapes(infmt);
+    wfile::FileHeader hdr {};
+    std::memcpy(hdr.magic, wfile::magic(), 8);
+    hdr.nlayers = shapes.size();
+    hdr.block = std::max(64, env_or("CB_WFILE_BLOCK", 1 << 16));
+
+    std::string fn = argv[3], tmpfn = fn + ".tmp";
+    std::ofstream os(tmpfn, std::ios::binary);
+    os.write((const char*) &hdr, sizeof(hdr));
+    std::size_t rawbytes = 0, bytes = sizeof(hdr);
+    for (auto &s: shapes) {
+        tensor_t w(std::size_t(s.Co) * s.Ci * s.Kh * s.Kw), back;
+        read_binary(weightfile, w);
+        if (!weightfile) {
+            std::cerr << argv[2] << " is shorter than " << argv[1] << " says" << std::endl;
+            return 1;
+        }
+        auto rec = wfile::encode(s, w, dt, bsize, sparsity, hdr.block);
+        std::istringstream is(std::string(rec.begin(), rec.end()));
+        std::vector<char> buf;
+        if (!wfile::decode(is, s, hdr.block, buf, back)) return 1;
+        double err = 0;
+        for (std::size_t i = 0; i < w.size(); i++)
+            if (back[i] != 0) err = std::max(err, double(std::fabs(w[i] - back[i])));
+        os.write(rec.data(), rec.size());
+        rawbytes += w.size() * sizeof(float);
+        bytes += rec.size();
+        std::cout << "wconvert," << s.Co << ',' << s.Ci << ',' << s.Kh
+                  << ',' << dtname << ',' << bsize << ',' << sparsity
+                  << ',' << w.size() * sizeof(float) << ',' << rec.size()
+                  << ',' << err << std::endl;
+    }
+    os.close();
+    if (!os) {
+        std::cerr << "cannot write " << tmpfn << std::endl;
+        return 1;
+    }
+    std::rename(tmpfn.c_str(), fn.c_str());
+    std::cout << "wconvert,total," << rawbytes << ',' << bytes << std::endl;
+    return 0;
+}
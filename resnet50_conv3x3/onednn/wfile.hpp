@@ -0,0 +1,327 @@
+#ifndef _WFILE_HPP_
+#define _WFILE_HPP_
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <numeric>
+#include <sstream>
+#include <vector>
+#include "dimidx.hpp"
+#include "tensorutils.hpp"
+
+// Compressed weight file (.cbw), the compact alternative to dat.bin.  A
+// FileHeader is followed per layer by a LayerHeader, the payload and one
+// CRC32C for every `block` payload bytes.  Values are fp32, IEEE half or
+// bfloat16.  A dense payload holds the F x C*K*K matrix; a sparse one holds
+// it as block CSR with 1 x bsize blocks along C*K*K (bsize 1 is plain
+// CSR): uint32 row pointers counted in blocks, the uint32 first column of
+// each block, then bsize values per block, zero-padded past C*K*K.
+// wconvert.cpp writes the file from fmt.txt and dat.bin; decode() checks
+// a layer and expands it, vectorized and in parallel, into the F x C x K
+// x K floats that every conv class packs from.
+namespace wfile {
+
+enum DType: std::uint8_t { FP32 = 0, FP16 = 1, BF16 = 2 };
+
+struct FileHeader {
+    char magic[8];
+    std::uint32_t nlayers, block;
+};
+
+struct LayerHeader {
+    std::uint32_t Co, Ci, Kh, Kw;
+    std::uint8_t dtype, bsize;      // bsize 0: dense
+    std::uint16_t reserved;
+    std::uint32_t nblocks;
+    std::uint64_t payload;
+};
+
+inline const char *magic() { return "CBWFILE1"; }
+
+inline std::size_t dtype_size(int dt) { return dt == FP32 ? 4 : 2; }
+
+inline const char *dtype_name(int dt) {
+    return dt == FP16 ? "fp16" : dt == BF16 ? "bf16" : "fp32";
+}
+
+// Castagnoli CRC, with the SSE4.2 instruction where the build has it
+inline std::uint32_t crc32c(const void *ptr, std::size_t size) {
+    auto p = (const unsigned char*) ptr;
+    std::uint32_t crc = ~0u;
+#ifdef __SSE4_2__
+    std::uint64_t crc64 = crc, word;
+    for (; size >= 8; p += 8, size -= 8) {
+        std::memcpy(&word, p, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = crc64;
+    for (; size; p++, size--) crc = _mm_crc32_u8(crc, *p);
+#else
+    for (; size; p++, size--) {
+        crc ^= *p;
+        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0x82f63b78u & (0u - (crc & 1)));
+    }
+#endif
+    return ~crc;
+}
+
+// round to nearest even, overflow to infinity
+inline std::uint16_t float_to_half(float f) {
+    std::uint32_t x;
+    std::memcpy(&x, &f, 4);
+    std::uint32_t sign = (x >> 16) & 0x8000, ax = x & 0x7fffffff;
+    if (ax > 0x7f800000) return sign | 0x7e00;
+    if (ax >= 0x477ff000) return sign | 0x7c00;
+    if (ax < 0x38800000) {
+        // subnormal: scaling by 2^24 is exact, nearbyint rounds to even
+        float v;
+        std::memcpy(&v, &ax, 4);
+        return sign | std::uint16_t(std::nearbyint(v * 16777216.0f));
+    }
+    std::uint32_t r = ax - 0x38000000;
+    r += 0xfff + ((r >> 13) & 1);
+    return sign | std::uint16_t(r >> 13);
+}
+
+inline std::uint16_t float_to_bf16(float f) {
+    std::uint32_t x;
+    std::memcpy(&x, &f, 4);
+    if ((x & 0x7fffffff) > 0x7f800000) return (x >> 16) | 0x40;
+    return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+// n values of type dt at src into floats at dst
+inline void widen(const char *src, int dt, std::size_t n, float *dst) {
+    auto h = (const std::uint16_t*) src;
+    auto range = DI::Range<std::size_t>(0, n).vectorize();
+    switch (dt) {
+    case FP16:
+        range.foreach([&] (std::size_t i, simd::Mask m) {
+            simd::VecF::load_half(h + i, m).store(dst + i, m);
+        });
+        break;
+    case BF16:
+        range.foreach([&] (std::size_t i, simd::Mask m) {
+            simd::VecF::load_bf16(h + i, m).store(dst + i, m);
+        });
+        break;
+    default:
+        std::memcpy(dst, src, n * sizeof(float));
+    }
+}
+
+// a word at any offset of a record, which need not be aligned
+inline std::uint32_t read_u32(const char *p) {
+    std::uint32_t v;
+    std::memcpy(&v, p, 4);
+    return v;
+}
+
+inline void append(std::vector<char> &out, const void *p, std::size_t size) {
+    out.insert(out.end(), (const char*) p, (const char*) p + size);
+}
+
+inline void append_value(std::vector<char> &out, float v, int dt) {
+    if (dt == FP32) return append(out, &v, 4);
+    std::uint16_t h = dt == FP16 ? float_to_half(v) : float_to_bf16(v);
+    append(out, &h, 2);
+}
+
+// One layer's record.  With bsize > 0 each row keeps the blocks of largest
+// L1 norm and drops the `sparsity` fraction of smallest ones, along with
+// any all-zero block.
+inline std::vector<char> encode(const ConvShape &s, const tensor_t &w, int dt,
+                                int bsize, float sparsity, std::uint32_t block) {
+    int F = s.Co, CKK = s.Ci * s.Kh * s.Kw;
+    LayerHeader hdr {};
+    hdr.Co = s.Co; hdr.Ci = s.Ci; hdr.Kh = s.Kh; hdr.Kw = s.Kw;
+    hdr.dtype = dt; hdr.bsize = bsize;
+    std::vector<char> payload;
+    if (bsize == 0) {
+        for (std::size_t i = 0; i < std::size_t(F) * CKK; i++)
+            append_value(payload, w[i], dt);
+    } else {
+        int nb = (CKK + bsize - 1) / bsize;
+        std::vector<std::uint32_t> rowptr {0}, cols;
+        std::vector<char> vals;
+        std::vector<float> norm(nb);
+        std::vector<int> order(nb);
+        for (int f = 0; f < F; f++) {
+            const float *row = w.data() + std::size_t(f) * CKK;
+            for (int b = 0; b < nb; b++) {
+                norm[b] = 0;
+                for (int c = b * bsize; c < std::min(CKK, (b + 1) * bsize); c++)
+                    norm[b] += std::fabs(row[c]);
+            }
+            std::iota(order.begin(), order.end(), 0);
+            std::stable_sort(order.begin(), order.end(),
+                             [&] (int a, int b) { return norm[a] > norm[b]; });
+            int keep = nb - int(sparsity * nb + 0.5f);
+            while (keep > 0 && norm[order[keep - 1]] == 0) keep--;
+            std::sort(order.begin(), order.begin() + keep);
+            for (int i = 0; i < keep; i++) {
+                int c0 = order[i] * bsize;
+                cols.push_back(c0);
+                for (int c = c0; c < c0 + bsize; c++)
+                    append_value(vals, c < CKK ? row[c] : 0.0f, dt);
+            }
+            rowptr.push_back(cols.size());
+        }
+        hdr.nblocks = cols.size();
+        append(payload, rowptr.data(), rowptr.size() * 4);
+        append(payload, cols.data(), cols.size() * 4);
+        payload.insert(payload.end(), vals.begin(), vals.end());
+    }
+    hdr.payload = payload.size();
+    std::vector<char> ret;
+    append(ret, &hdr, sizeof(hdr));
+    ret.insert(ret.end(), payload.begin(), payload.end());
+    for (std::size_t b0 = 0; b0 < payload.size(); b0 += block) {
+        auto crc = crc32c(payload.data() + b0, std::min<std::size_t>(block, payload.size() - b0));
+        append(ret, &crc, 4);
+    }
+    return ret;
+}
+
+inline std::string layer_name(const ConvShape &s) {
+    std::ostringstream os;
+    os << "wfile: layer " << s.Co << 'x' << s.Ci << 'x' << s.Kh << 'x' << s.Kw << ": ";
+    return os.str();
+}
+
+// Reads the next layer's header, payload and checksums.  Returns false,
+// with the reason on stderr, on a shape other than s or a short or
+// malformed record.
+inline bool read_record(std::istream &is, const ConvShape &s, std::uint32_t block,
+                        LayerHeader &hdr, std::vector<char> &buf) {
+    auto name = layer_name(s);
+    if (!is.read((char*) &hdr, sizeof(hdr))) {
+        std::cerr << name << "truncated file" << std::endl;
+        return false;
+    }
+    if (int(hdr.Co) != s.Co || int(hdr.Ci) != s.Ci || int(hdr.Kh) != s.Kh
+            || int(hdr.Kw) != s.Kw || hdr.dtype > BF16) {
+        std::cerr << name << "record is " << hdr.Co << 'x' << hdr.Ci << 'x'
+                  << hdr.Kh << 'x' << hdr.Kw << ' ' << int(hdr.dtype) << std::endl;
+        return false;
+    }
+    int F = s.Co, CKK = s.Ci * s.Kh * s.Kw, bs = hdr.bsize;
+    std::size_t dsz = dtype_size(hdr.dtype);
+    std::size_t want = bs ? 4 * (std::size_t(F) + 1 + hdr.nblocks) + hdr.nblocks * bs * dsz
+                          : std::size_t(F) * CKK * dsz;
+    std::size_t nck = (hdr.payload + block - 1) / block;
+    buf.resize(hdr.payload + nck * 4);
+    if (hdr.payload != want || !is.read(buf.data(), buf.size())) {
+        std::cerr << name << "short or malformed payload" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Checks a record read by read_record and expands it into w, false with
+// the reason on stderr if a checksum or block index is off.
+inline bool expand(const ConvShape &s, std::uint32_t block, const LayerHeader &hdr,
+                   const std::vector<char> &buf, tensor_t &w) {
+    auto name = layer_name(s);
+    int F = s.Co, CKK = s.Ci * s.Kh * s.Kw, bs = hdr.bsize;
+    std::size_t dsz = dtype_size(hdr.dtype);
+    std::size_t nck = (hdr.payload + block - 1) / block;
+    const char *p = buf.data();
+    const char *sums = p + hdr.payload;
+    long nbad = 0;
+    #pragma omp parallel for reduction(+:nbad)
+    for (long i = 0; i < long(nck); i++) {
+        std::size_t b0 = i * std::size_t(block);
+        nbad += crc32c(p + b0, std::min<std::size_t>(block, hdr.payload - b0))
+                != read_u32(sums + 4 * i);
+    }
+    if (nbad) {
+        std::cerr << name << "checksum mismatch in " << nbad << " of "
+                  << nck << " blocks" << std::endl;
+        return false;
+    }
+    w.resize(std::size_t(F) * CKK);
+    if (!bs) {
+        const std::size_t chunk = 1 << 14, n = w.size();
+        #pragma omp parallel for
+        for (std::size_t c0 = 0; c0 < n; c0 += chunk)
+            widen(p + c0 * dsz, hdr.dtype, std::min(chunk, n - c0), w.data() + c0);
+        return true;
+    }
+    std::vector<std::uint32_t> rowptr(F + 1), cols(hdr.nblocks);
+    std::memcpy(rowptr.data(), p, 4 * rowptr.size());
+    std::memcpy(cols.data(), p + 4 * rowptr.size(), 4 * cols.size());
+    const char *vals = p + 4 * (std::size_t(F) + 1 + hdr.nblocks);
+    bool ok = rowptr[0] == 0 && rowptr[F] == hdr.nblocks;
+    for (int f = 0; ok && f < F; f++) ok = rowptr[f] <= rowptr[f + 1];
+    for (std::uint32_t j = 0; ok && j < hdr.nblocks; j++) ok = cols[j] < std::uint32_t(CKK);
+    if (!ok) {
+        std::cerr << name << "bad block index" << std::endl;
+        return false;
+    }
+    #pragma omp parallel for
+    for (int f = 0; f < F; f++) {
+        float *row = w.data() + std::size_t(f) * CKK;
+        std::fill(row, row + CKK, 0.0f);
+        for (std::uint32_t j = rowptr[f]; j < rowptr[f + 1]; j++)
+            widen(vals + j * bs * dsz, hdr.dtype, std::min<int>(bs, CKK - cols[j]),
+                  row + cols[j]);
+    }
+    return true;
+}
+
+inline bool decode(std::istream &is, const ConvShape &s, std::uint32_t block,
+                   std::vector<char> &buf, tensor_t &w) {
+    LayerHeader hdr;
+    return read_record(is, s, block, hdr, buf) && expand(s, block, hdr, buf, w);
+}
+
+
+// Weights of consecutive layers from either dat.bin or a .cbw file, told
+// apart by the magic.  Packed layers report their size and read and
+// decode times as wfile lines.
+class WeightReader {
+    std::istream &is;
+    bool packed;
+    std::uint32_t block;
+    std::vector<char> buf;
+
+public:
+    WeightReader(std::istream &is): is(is), packed(false), block(0) {
+        FileHeader hdr;
+        if (is.read((char*) &hdr, sizeof(hdr)) && !std::memcmp(hdr.magic, magic(), 8)
+                && hdr.block > 0) {
+            packed = true;
+            block = hdr.block;
+        } else {
+            is.clear();
+            is.seekg(0);
+        }
+    }
+
+    bool next(const ConvShape &s, tensor_t &w) {
+        if (!packed) {
+            w.resize(std::size_t(s.Co) * s.Ci * s.Kh * s.Kw);
+            read_binary(is, w);
+            return true;
+        }
+        LayerHeader hdr;
+        auto t1 = steady_clock::now();
+        if (!read_record(is, s, block, hdr, buf)) return false;
+        auto t2 = steady_clock::now();
+        if (!expand(s, block, hdr, buf, w)) return false;
+        auto t3 = steady_clock::now();
+        std::cout << "wfile," << s.Co << ',' << s.Ci << ',' << s.Kh
+                  << ',' << dtype_name(hdr.dtype) << ',' << int(hdr.bsize)
+                  << ',' << sizeof(hdr) + buf.size()
+                  << ',' << time_diff(t2, t1) * 1000 << ',' << time_diff(t3, t2) * 1000
+                  << std::endl;
+        return true;
+    }
+};
+
+}  // end namespace
+
+#endif  // _WFILE_HPP_